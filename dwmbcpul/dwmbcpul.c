@@ -2,14 +2,21 @@
  *
  *  Core frequency changes very rapidly, too rapidly for a single check
  *  per second to be representative of the actual values. For that
- *  reason, this program takes an average of N number of readings
- *  in the span of 1 second and then that average is redirected
+ *  reason, this program takes an average of many readings in the
+ *  span of 1 second, more while the frequencies are changing and
+ *  fewer while they are stable, and then that average is redirected
  *  to a file and a signal is sent to dwmblocks to read from there.
+ *  Where cpufreq statistics are available, the exact average is taken
+ *  from the time spent at each frequency instead, once per second.
+ *  In utilization mode the bars show how busy each CPU was instead,
+ *  from the jiffies in /proc/stat, with frequency as their color.
  */
 
 #define _DEFAULT_SOURCE /* gets rid of usleep undefined warning */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <glob.h>       /* https://linux.die.net/man/3/glob */
 #include <unistd.h>
@@ -17,13 +24,36 @@
 #include <sys/prctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <signal.h>
 #include <fcntl.h>
 
-#define READFREQ    8           /* how many readings to take (Hz) */
+#define READFREQ    16          /* most readings to take (Hz), while frequencies change */
+#define READFREQ_MIN 2          /* fewest readings to take (Hz), while they are stable */
+#define STABLE      5           /* largest change between readings that counts as stable (% of max) */
+#define READ_SIZE   64          /* enough for any single-value sysfs/procfs file */
+#define TIS_SIZE    4096        /* enough for time_in_state with ~200 frequencies */
+#define TIME_IN_STATE           /* comment out to always sample scaling_cur_freq */
+#define UTILIZATION             /* bars show per-CPU load from /proc/stat, comment out for frequency */
+#define FREQ_OVERLAY            /* with UTILIZATION, color the bars by frequency instead of load */
+#define LIST_SIZE   8192        /* enough for a list of ~1500 CPUs */
 #define HIST_FILE  "dwmbcpul"   /* name of the file in tmp dir  */
-#define MAX_CORES   32          /* note that more cores means longer output */
+#define ROOT_ENV   "DWMBCPUL_ROOT" /* variable with a prefix for /sys and /proc, e.g. a fake tree */
+#define PATH_SIZE   512
+#define BENCH_TICKS 10000       /* default number of ticks for --bench, each kind runs at most 1 s */
+#define GROUP       GROUP_AUTO  /* GROUP_NONE, GROUP_POLICY, GROUP_CLUSTER, GROUP_NODE or GROUP_AUTO */
+#define MAX_BARS    16          /* with GROUP_AUTO, group ever more coarsely until this many bars fit */
+#define STAT        STAT_EWMA   /* what bars show of the last WINDOW seconds: STAT_LAST, STAT_EWMA,
+                                   STAT_MIN, STAT_MAX or STAT_P95 */
+#define WINDOW      10          /* seconds kept for STAT_MIN, STAT_MAX and STAT_P95 */
+#define EWMA_ALPHA  0.3f        /* weight of the last second in STAT_EWMA */
+#define P95_BUCKETS 50          /* resolution of STAT_P95, 2% */
+//#define SPARKLINE   16          /* draw the last N seconds of every bar as a graph instead */
 #define DWMB_SIG    8           /* dwmblocks's RTMIN+x update signal */
+#define DWMB_NAME  "dwmblocks"  /* signalled only if the parent process has this name */
+//#define SHOW_SIG    9         /* RTMIN+x your dwmblocks sends when the status is shown or hidden */
+#define SHOW_POLL   5           /* with SHOW_SIG, still check every N seconds in case it is not sent */
 #define SHM_NAME "/dwmstatus"
 #define SHOW_BAR_BYTE 5         /* the byte denoting bar visibility */
 #define SHOW_STATUS_BYTE 6      /* the byte denoting status visibility */
@@ -31,28 +61,139 @@
 #define ICON ""
 #define COL1 "#BB4444"
 #define COL2 "#FF9999"
+#define RANGE_COL "#666666"     /* min to max range of grouped bars */
 #define BARH 19
 #define PAD  3
 
+#if !defined(UTILIZATION) || defined(FREQ_OVERLAY)
+#define FREQUENCY               /* frequencies are read at all */
+#endif
+
+#define NSEC 1000000000ULL
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define FRAG_SIZE 16             /* "^r0,YY,1,HH^^f1^", one sparkline column */
+#ifdef SPARKLINE
+#define BAR_SIZE (32 + SPARKLINE * FRAG_SIZE) /* longest output of spark() */
+#else
+#define BAR_SIZE 96              /* longest output of bar() */
+#endif
 #define SHOW_STATUS (sharedmemory[SHOW_BAR_BYTE - 1] && sharedmemory[SHOW_STATUS_BYTE - 1])
 
+enum { GROUP_NONE, GROUP_POLICY, GROUP_CLUSTER, GROUP_NODE, GROUP_AUTO };
+enum { STAT_LAST, STAT_EWMA, STAT_MIN, STAT_MAX, STAT_P95 };
+
+/* Numbers of values in a Window, ordered so that the values are
+ * monotonic; the front is the min or max of the window */
+typedef struct {
+    uint32_t q[WINDOW];
+    unsigned head, len;
+} Deque;
+
+/* The last WINDOW values of one bar, in per mille, with aggregates that
+ * are all updated in O(1) per value */
+typedef struct {
+    uint16_t val[WINDOW];               /* value number k is at k % WINDOW */
+    uint32_t n;                         /* values added */
+    float ewma;
+    Deque min, max;
+    uint16_t hist[P95_BUCKETS];         /* histogram of val[] */
+} Window;
+
+#ifdef SPARKLINE
+/* The history of one bar, kept as the draw commands of its columns.
+ * Every column is drawn relative to the one before it, so its command
+ * never changes; each one is kept twice, at k % SPARKLINE and SPARKLINE
+ * after, so that the last SPARKLINE are always in one piece. */
+typedef struct {
+    uint32_t n;                         /* columns added */
+    char frag[2 * SPARKLINE * FRAG_SIZE];
+} Spark;
+#endif
+
 // Variables
 char fpath[100];
-FILE *avgl_file;
-FILE *core_file[MAX_CORES] = {0};
-long double cores[MAX_CORES] = {0}; 
-long double cores_max[MAX_CORES];
-float avgload;
+const char *root = "";               /* prefix of every sysfs and procfs path */
+char tmppath[104];                   /* written and renamed over fpath */
+char *out, *outbuf;                  /* last output written to fpath, and the next one */
+size_t outlen, outsize;
+pid_t dwmb_pid;                      /* parent to signal on changes, or 0 */
+int bench_file;                      /* fpath is a private file of --bench, removed on exit */
+uint64_t syscalls;                   /* made by the ticks so far, for --bench */
+int avgl_fd = -1;
+
+// Per policy, corec of each
+int *core_fd;
+uint64_t *cores;                     /* sum of readings in kHz, times the ms each stands for */
+uint64_t *cur_khz;                   /* last reading */
+uint64_t *cores_max;
+int *tis_fd;                         /* cpufreq stats/time_in_state, or -1 */
+uint64_t *tis_ft, *tis_t;            /* last sums of freq * time and time */
+unsigned *readc;                     /* ms covered by the readings in cores[] */
+int *policy_cpu;                     /* first CPU of each policy, or -1 */
+int sampling;                        /* set if any core has no time_in_state */
+uint64_t avgload;                    /* 1-minute load average * 100 */
 size_t corec;
-unsigned readc[MAX_CORES] = {0};
+
+// Per CPU, ncpus of each, plus one in front for all CPUs where noted
+size_t ncpus;                        /* CPU IDs are below this */
+int stat_fd = -1;
+char *stat_buf;
+size_t stat_size;
+uint64_t *stat_busy, *stat_total;    /* last jiffies, [0] is all CPUs */
+unsigned *util;                      /* busy per mille over the last interval, [0] is all CPUs */
+size_t cpuc;                         /* CPUs in /proc/stat, from 0 to the highest ID */
+int *cpu_policy;                     /* index of each CPU's policy in cores[], or -1 */
+
+// Bars are drawn for units, CPUs or policies, or for groups of them
+size_t unitcap;                      /* most units there can be, CPUs may come online */
+int *unit_group;                     /* group of each unit, or -1 */
+size_t groupc;                       /* 0 when every unit has its own bar */
+float *group_lo, *group_hi, *group_sum, *group_heat;
+unsigned *group_n;
+Window *windows;                     /* one per unit */
+#ifdef SPARKLINE
+Spark *sparks;                       /* one per bar */
+#endif
+
+int timer_fd = -1;
 char *sharedmemory;
 int sharedmemoryfd;
 
 // Declarations
 void die(const char *msg);
+void *xcalloc(size_t n, size_t size);
+void root_path(char *buf, size_t size, const char *fmt, ...);
+int parse_uint(const char **p, const char *end, uint64_t *val);
+int read_value(int fd, int decimals, uint64_t *val);
+int read_tis(int fd, uint64_t *ft, uint64_t *t);
+void tis_update();
+unsigned sample(unsigned ms);
+uint64_t now_ns();
+void sleep_until(uint64_t t);
+size_t stat_cpus();
+int stat_update();
+void read_cpus(int fd, size_t policy);
+long cpu_key(size_t cpu, int by);
+size_t make_groups(int by);
+float freq_load(size_t i);
+size_t unitc();
+float unit_load(size_t i);
+float unit_heat(size_t i, float load);
+void deque_push(Deque *d, const uint16_t *val, uint32_t k, int max);
+void window_add(Window *w, float load);
+float window_get(const Window *w);
+void windows_update();
+size_t bar(char *buf, size_t size, float load, float heat, float lo, float hi);
+#ifdef SPARKLINE
+void spark_clear(Spark *sp);
+size_t spark(Spark *sp, char *buf, size_t size, float load, float heat);
+#endif
+size_t draw(size_t b, char *buf, size_t size, float load, float heat, float lo, float hi);
 void status_clear();
 void send();
+void update();
+int bench(long ticks);
 void termhandler(int signum);
 void cleanup();
 
@@ -65,39 +206,699 @@ void die(const char *msg)
     exit(EXIT_FAILURE);
 }
 
+/* calloc, but there is nothing to do without the tables */
+void *xcalloc(size_t n, size_t size)
+{
+    void *p;
+    if (!(p = calloc(n ? n : 1, size))) {
+        die("out of memory");
+    }
+    return p;
+}
+
+/* Format a sysfs or procfs path, under root */
+void root_path(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    size_t len = snprintf(buf, size, "%s", root);
+    va_start(ap, fmt);
+    vsnprintf(buf + MIN(len, size - 1), size - MIN(len, size - 1), fmt, ap);
+    va_end(ap);
+}
+
+/* Parse a decimal integer at *p, advancing *p past it. Returns nonzero
+ * if there is no digit. */
+int parse_uint(const char **p, const char *end, uint64_t *val)
+{
+    const char *s = *p;
+    uint64_t v = 0;
+    while (s != end && *s >= '0' && *s <= '9') {
+        v = v * 10 + (*s++ - '0');
+    }
+    if (s == *p) {
+        return 1;
+    }
+    *p = s;
+    *val = v;
+    return 0;
+}
+
+/* Read the number at the start of fd as a fixed-point integer with the
+ * given number of decimal places, e.g. "0.52" with 2 decimals is 52.
+ * The file is read from offset 0 with a single pread, so the same fd
+ * can be sampled over and over. Returns nonzero on failure. */
+int read_value(int fd, int decimals, uint64_t *val)
+{
+    char buf[READ_SIZE];
+    ssize_t len = pread(fd, buf, sizeof buf, 0);
+    syscalls++;
+    if (len <= 0) {
+        return 1;
+    }
+    const char *p = buf, *end = buf + len;
+    uint64_t v;
+    if (parse_uint(&p, end, &v)) {
+        return 1;
+    }
+    if (p != end && *p == '.') {
+        p++;
+    }
+    for (; decimals > 0; decimals--) {
+        v *= 10;
+        if (p != end && *p >= '0' && *p <= '9') {
+            v += *p++ - '0';
+        }
+    }
+    *val = v;
+    return 0;
+}
+
+/* Sum up freq * time and time over every line of a time_in_state
+ * file, which lists the time in 10 ms units spent at each frequency.
+ * The average frequency over an interval is the ratio of the deltas
+ * of the two sums. Returns nonzero on failure. */
+int read_tis(int fd, uint64_t *ft, uint64_t *t)
+{
+    char buf[TIS_SIZE];
+    ssize_t len = pread(fd, buf, sizeof buf, 0);
+    syscalls++;
+    if (len <= 0 || len == sizeof buf) {
+        return 1;
+    }
+    const char *p = buf, *end = buf + len;
+    *ft = *t = 0;
+    while (p != end) {
+        uint64_t freq, time;
+        if (parse_uint(&p, end, &freq) || p == end || *p++ != ' '
+                || parse_uint(&p, end, &time) || p == end || *p++ != '\n') {
+            return 1;
+        }
+        *ft += freq * time;
+        *t += time;
+    }
+    return 0;
+}
+
+/* Set cores[] to the exact average frequency since the last call, for
+ * every core that has time_in_state. Cores whose file stops working go
+ * back to sampling scaling_cur_freq. */
+void tis_update()
+{
+    for (size_t i = 0; i < corec; i++) {
+        uint64_t ft, t;
+        if (tis_fd[i] == -1) {
+            continue;
+        }
+        if (read_tis(tis_fd[i], &ft, &t)) {
+            fprintf(stderr, "dwmbcpul: failed to parse time_in_state\n");
+            close(tis_fd[i]);
+            syscalls++;
+            tis_fd[i] = -1;
+            sampling = 1;
+            continue;
+        }
+        if (t > tis_t[i]) {
+            cores[i] = (ft - tis_ft[i]) / (t - tis_t[i]);
+            readc[i] = 1;
+        }
+        tis_ft[i] = ft;
+        tis_t[i] = t;
+    }
+}
+
+/* Add a reading of scaling_cur_freq, weighted by the ms it stands for,
+ * to every core without time_in_state. Returns the largest change since
+ * the previous reading in % of the core's maximum frequency. */
+unsigned sample(unsigned ms)
+{
+    unsigned change = 0;
+    for (size_t i = 0; i < corec; i++) {
+        uint64_t khz;
+        if (core_fd[i] == -1 || tis_fd[i] != -1) {
+            continue;
+        }
+        if (read_value(core_fd[i], 0, &khz)) {
+            fprintf(stderr, "dwmbcpul: failed to parse scaling_cur_freq\n");
+            continue;
+        }
+        cores[i] += khz * ms;
+        readc[i] += ms;
+        if (cores_max[i]) {
+            uint64_t d = khz > cur_khz[i]? khz - cur_khz[i] : cur_khz[i] - khz;
+            change = MAX(change, (unsigned)(d * 100 / cores_max[i]));
+        }
+        cur_khz[i] = khz;
+    }
+    return change;
+}
+
+/* clock_gettime() is served by the vDSO without a syscall */
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/* Block until the absolute monotonic time t, so that the time spent
+ * working does not add up over the ticks */
+void sleep_until(uint64_t t)
+{
+    struct itimerspec its = {{0, 0}, {t / NSEC, t % NSEC}};
+    uint64_t expirations;
+    syscalls += 2;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL)
+            || read(timer_fd, &expirations, sizeof expirations) != sizeof expirations) {
+        die("timerfd failed");
+    }
+}
+
+/* Read all of /proc/stat, growing stat_buf to fit it with room to
+ * spare, and return the highest CPU ID in it plus one */
+size_t stat_cpus()
+{
+    ssize_t len;
+    stat_size = 4096;
+    while (1) {
+        if (!(stat_buf = realloc(stat_buf, stat_size))) {
+            die("out of memory");
+        }
+        if ((len = pread(stat_fd, stat_buf, stat_size, 0)) < (ssize_t)stat_size) {
+            break;
+        }
+        stat_size *= 2;
+    }
+    stat_size *= 2;
+    if (!(stat_buf = realloc(stat_buf, stat_size))) {
+        die("out of memory");
+    }
+
+    size_t n = 0;
+    const char *p = stat_buf, *end = stat_buf + (len > 0? len : 0);
+    while (end - p > 3 && !memcmp(p, "cpu", 3)) {
+        uint64_t cpu;
+        p += 3;
+        if (!parse_uint(&p, end, &cpu)) {
+            n = MAX(n, cpu + 1);
+        }
+        while (p != end && *p++ != '\n');
+    }
+    return n;
+}
+
+/* Set util[] to the share of non-idle jiffies of every CPU since the
+ * last call. The cpu lines come first in /proc/stat and one pread into
+ * stat_buf gets them all; they are parsed in place without allocating.
+ * Returns nonzero on failure. */
+int stat_update()
+{
+    ssize_t len = pread(stat_fd, stat_buf, stat_size, 0);
+    syscalls++;
+    if (len <= 0) {
+        return 1;
+    }
+    const char *p = stat_buf, *end = stat_buf + len;
+    while (end - p > 3 && !memcmp(p, "cpu", 3)) {
+        // user nice system idle iowait irq softirq steal, guest is part of user
+        uint64_t cpu, v[8] = {0}, total = 0;
+        size_t i = 0;
+        p += 3;
+        if (!parse_uint(&p, end, &cpu)) {
+            i = cpu + 1;
+        }
+        for (int k = 0; k < 8; k++) {
+            while (p != end && *p == ' ') {
+                p++;
+            }
+            if (parse_uint(&p, end, &v[k])) {
+                break;
+            }
+            total += v[k];
+        }
+        while (p != end && *p++ != '\n');
+        if (i > ncpus) {
+            continue;
+        }
+
+        // iowait is allowed to go backwards, so the busy delta is clamped
+        uint64_t busy = total - v[3] - v[4];
+        if (total > stat_total[i]) {
+            uint64_t db = busy > stat_busy[i]? busy - stat_busy[i] : 0;
+            util[i] = db * 1000 / (total - stat_total[i]);
+            util[i] = util[i] > 1000? 1000 : util[i];
+        }
+        stat_busy[i] = busy;
+        stat_total[i] = total;
+        cpuc = i > cpuc? i : cpuc;
+    }
+    return p == stat_buf;
+}
+
+/* Map the CPUs listed in a policy's related_cpus to it */
+void read_cpus(int fd, size_t policy)
+{
+    static char buf[LIST_SIZE];
+    ssize_t len = pread(fd, buf, sizeof buf, 0);
+    const char *p = buf, *end = buf + (len > 0? len : 0);
+    uint64_t cpu;
+    while (!parse_uint(&p, end, &cpu)) {
+        if (cpu < ncpus) {
+            cpu_policy[cpu] = policy;
+            if (policy_cpu[policy] == -1) {
+                policy_cpu[policy] = cpu;
+            }
+        }
+        if (p != end) {
+            p++;
+        }
+    }
+}
+
+/* What CPUs are grouped by: their policy, cluster (or package where
+ * there are no clusters) or NUMA node. Returns -1 if unknown. */
+long cpu_key(size_t cpu, int by)
+{
+    char fp[PATH_SIZE];
+    int fd;
+    uint64_t key;
+    switch (by) {
+    case GROUP_POLICY:
+        return cpu_policy[cpu];
+    case GROUP_CLUSTER:
+        root_path(fp, sizeof fp, "/sys/devices/system/cpu/cpu%zu/topology/cluster_id", cpu);
+        if ((fd = open(fp, O_RDONLY)) == -1) {
+            root_path(fp, sizeof fp, "/sys/devices/system/cpu/cpu%zu/topology/physical_package_id", cpu);
+            fd = open(fp, O_RDONLY);
+        }
+        if (fd == -1) {
+            return -1;
+        }
+        if (read_value(fd, 0, &key)) {
+            key = -1;
+        }
+        close(fd);
+        return key;
+    case GROUP_NODE: {
+        glob_t nglob;
+        const char *p, *end;
+        root_path(fp, sizeof fp, "/sys/devices/system/cpu/cpu%zu/node*", cpu);
+        if (glob(fp, 0, NULL, &nglob)) {
+            return -1;
+        }
+        p = strrchr(nglob.gl_pathv[0], '/') + 5;
+        end = p + strlen(p);
+        if (parse_uint(&p, end, &key)) {
+            key = -1;
+        }
+        globfree(&nglob);
+        return key;
+    }
+    }
+    return -1;
+}
+
+/* Put the units whose CPUs have the same key in the same group, in
+ * order of appearance. Units that appear later are left out with -1.
+ * Returns the number of groups, or 0 if no CPU has a key this way. */
+size_t make_groups(int by)
+{
+    size_t n = 0, units = unitc();
+    int known = 0;
+    long *keys = xcalloc(unitcap, sizeof *keys);
+    for (size_t i = units; i < unitcap; i++) {
+        unit_group[i] = -1;
+    }
+    for (size_t i = 0; i < units; i++) {
+#ifdef UTILIZATION
+        long key = cpu_key(i, by);
+#else
+        long key = policy_cpu[i] == -1? -1 : cpu_key(policy_cpu[i], by);
+#endif
+        size_t g = 0;
+        while (g < n && keys[g] != key) {
+            g++;
+        }
+        if (g == n) {
+            keys[n++] = key;
+        }
+        unit_group[i] = g;
+        known |= key != -1;
+    }
+    free(keys);
+    return known? n : 0;
+}
+
+/* Average frequency of policy i over the last interval relative to its maximum */
+float freq_load(size_t i)
+{
+    return readc[i] && cores_max[i]? (float)cores[i] / readc[i] / cores_max[i] : 0;
+}
+
+size_t unitc()
+{
+#ifdef UTILIZATION
+    return cpuc;
+#else
+    return corec;
+#endif
+}
+
+/* Load of unit i over the last interval, from 0 to 1 */
+float unit_load(size_t i)
+{
+#ifdef UTILIZATION
+    return util[i + 1] / 1000.0f;
+#else
+    return freq_load(i);
+#endif
+}
+
+/* Color of the bar of unit i showing load, from 0 to 1 */
+float unit_heat(size_t i, float load)
+{
+#if defined(UTILIZATION) && defined(FREQ_OVERLAY)
+    return cpu_policy[i] != -1? freq_load(cpu_policy[i]) : load;
+#else
+    (void)i;
+    return load;
+#endif
+}
+
+/* Add value number k to a min (max = 0) or max deque, dropping the
+ * values it makes irrelevant from the back and the one leaving the
+ * window from the front */
+void deque_push(Deque *d, const uint16_t *val, uint32_t k, int max)
+{
+    if (d->len && k - d->q[d->head] >= WINDOW) {
+        d->head = (d->head + 1) % WINDOW;
+        d->len--;
+    }
+    uint16_t v = val[k % WINDOW];
+    while (d->len) {
+        uint16_t back = val[d->q[(d->head + d->len - 1) % WINDOW] % WINDOW];
+        if (max? back > v : back < v) {
+            break;
+        }
+        d->len--;
+    }
+    d->q[(d->head + d->len++) % WINDOW] = k;
+}
+
+/* The histogram bucket of a value from 0 to 1000, each holding 1001 / P95_BUCKETS values */
+unsigned p95_bucket(uint16_t v)
+{
+    return v * P95_BUCKETS / 1001;
+}
+
+void window_add(Window *w, float load)
+{
+    uint16_t v = load < 0? 0 : load > 1? 1000 : (uint16_t)(load * 1000 + 0.5f);
+    uint16_t *slot = &w->val[w->n % WINDOW];
+    if (w->n >= WINDOW) {
+        w->hist[p95_bucket(*slot)]--;
+    }
+    *slot = v;
+    w->hist[p95_bucket(v)]++;
+    deque_push(&w->min, w->val, w->n, 0);
+    deque_push(&w->max, w->val, w->n, 1);
+    w->ewma = w->n? w->ewma + EWMA_ALPHA * (v - w->ewma) : v;
+    w->n++;
+}
+
+/* The STAT of a window with at least one value, from 0 to 1 */
+float window_get(const Window *w)
+{
+    uint16_t last = w->val[(w->n - 1) % WINDOW];
+    uint16_t max = w->val[w->max.q[w->max.head] % WINDOW];
+    uint16_t min = w->val[w->min.q[w->min.head] % WINDOW];
+    unsigned count = MIN(w->n, WINDOW), seen = 0, b = 0;
+    switch (STAT) {
+    case STAT_EWMA:
+        return w->ewma / 1000;
+    case STAT_MIN:
+        return min / 1000.0f;
+    case STAT_MAX:
+        return max / 1000.0f;
+    case STAT_P95:
+        // The largest value of the bucket holding the 95th percentile,
+        // within what the window actually holds
+        for (; b < P95_BUCKETS - 1; b++) {
+            if ((seen += w->hist[b]) * 100 >= count * 95) {
+                break;
+            }
+        }
+        return MAX(MIN(((b + 1) * 1001 - 1) / P95_BUCKETS, max), min) / 1000.0f;
+    }
+    return last / 1000.0f;
+}
+
+/* Add the last interval to the window of every unit */
+void windows_update()
+{
+    for (size_t i = 0; i < unitc(); i++) {
+        window_add(&windows[i], unit_load(i));
+    }
+}
+
+/* Write a bar to buf, with the range from lo to hi marked around it for
+ * groups: a line at lo and a darker bar on top up to hi */
+size_t bar(char *buf, size_t size, float load, float heat, float lo, float hi)
+{
+    char col[8];
+    float max_h = BARH - (2 * PAD);
+    sprintf(col, "#%02x%02x00", (int)(180 + (heat * 75)), (int)(255 - (heat * 255)));
+    col[7] = '\0';
+    int h = (int)(max_h * load), h_lo = (int)(max_h * lo), h_hi = (int)(max_h * hi);
+    int y = BARH - PAD - h;
+    size_t len = snprintf(buf, size, "^c%s^^r0,%d,2,%d^", col, y, h);
+    if (h_hi > h && len < size) {
+        len += snprintf(buf + len, size - len, "^c%s^^r0,%d,2,%d^", RANGE_COL, BARH - PAD - h_hi, h_hi - h);
+    }
+    if (h_lo < h && len < size) {
+        len += snprintf(buf + len, size - len, "^c%s^^r0,%d,2,1^", RANGE_COL, BARH - PAD - MAX(h_lo, 1));
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "^f3^");
+    }
+    return len;
+}
+
 void status_clear()
 {
     FILE *file;
     if ((file = fopen(fpath, "w")) != NULL) {
         fclose(file);
     }
+    outlen = 0;
+}
+
+#ifdef SPARKLINE
+/* Fill the history with empty columns */
+void spark_clear(Spark *sp)
+{
+    for (size_t k = 0; k < 2 * SPARKLINE; k++) {
+        memcpy(sp->frag + k * FRAG_SIZE, "^r0,00,1,00^^f1^", FRAG_SIZE);
+        sp->frag[k * FRAG_SIZE + 4] = '0' + (BARH - PAD) / 10;
+        sp->frag[k * FRAG_SIZE + 5] = '0' + (BARH - PAD) % 10;
+    }
+    sp->n = 0;
 }
 
+/* Add load to the history and write it to buf as a graph with a column
+ * per second, colored by heat. Only the new column is formatted. */
+size_t spark(Spark *sp, char *buf, size_t size, float load, float heat)
+{
+    char col[8], frag[FRAG_SIZE];
+    float max_h = BARH - (2 * PAD);
+    size_t k = sp->n++ % SPARKLINE;
+    int h = (int)(max_h * load), y = BARH - PAD - h;
+    memcpy(frag, "^r0,00,1,00^^f1^", FRAG_SIZE);
+    frag[4] = '0' + y / 10;
+    frag[5] = '0' + y % 10;
+    frag[9] = '0' + h / 10;
+    frag[10] = '0' + h % 10;
+    memcpy(sp->frag + k * FRAG_SIZE, frag, FRAG_SIZE);
+    memcpy(sp->frag + (k + SPARKLINE) * FRAG_SIZE, frag, FRAG_SIZE);
+
+    sprintf(col, "#%02x%02x00", (int)(180 + (heat * 75)), (int)(255 - (heat * 255)));
+    col[7] = '\0';
+    size_t len = snprintf(buf, size, "^c%s^", col);
+    if (len + SPARKLINE * FRAG_SIZE < size) {
+        memcpy(buf + len, sp->frag + (k + 1) * FRAG_SIZE, SPARKLINE * FRAG_SIZE);
+        len += SPARKLINE * FRAG_SIZE;
+    }
+    if (len < size) {
+        len += snprintf(buf + len, size - len, "^f2^");
+    }
+    return len;
+}
+#endif
+
+/* Write bar number b, as a bar or a sparkline */
+size_t draw(size_t b, char *buf, size_t size, float load, float heat, float lo, float hi)
+{
+#ifdef SPARKLINE
+    (void)lo;
+    (void)hi;
+    return spark(&sparks[b], buf, size, load, heat);
+#else
+    (void)b;
+    return bar(buf, size, load, heat, lo, hi);
+#endif
+}
+
+/* Render the status, and if it differs from the last one replace the
+ * file with it in one rename, so that it is never read half-written,
+ * and tell dwmblocks to redraw */
 void send()
 {
-    FILE *file;
-    if ((file = fopen(fpath, "w")) != NULL) {
+    char *buf = outbuf;
+    size_t units = unitc();
+#ifdef UTILIZATION
+    int headline = util[0] / 10;
+#else
+    int headline = avgload / corec;
+#endif
+    size_t len = snprintf(buf, outsize, "^c%s^%s^f1^^c%s^^f1^%d%%^f3^", COL1, ICON, COL2, headline);
 
-        // Overwrite file contents with a new line beginning
-        chmod(fpath, 0600);
-        fprintf(file, "^c%s^%s^f1^^c%s^^f1^%d%%^f3^", COL1, ICON, COL2, (int)(avgload * 100));
-        fclose(file);
+    // Append core bars, or the mean, min and max of every group
+    float load, heat;
+    if (!groupc) {
+        for (size_t i = 0; i < units && len < outsize; i++) {
+            load = window_get(&windows[i]);
+            heat = unit_heat(i, load);
+            len += draw(i, buf + len, outsize - len, load, heat, load, load);
+        }
+    } else {
+        for (size_t g = 0; g < groupc; g++) {
+            group_lo[g] = 1;
+            group_hi[g] = group_sum[g] = group_heat[g] = 0;
+            group_n[g] = 0;
+        }
+        for (size_t i = 0; i < units; i++) {
+            int g = unit_group[i];
+            if (g == -1) {
+                continue;
+            }
+            load = window_get(&windows[i]);
+            heat = unit_heat(i, load);
+            group_lo[g] = MIN(group_lo[g], load);
+            group_hi[g] = MAX(group_hi[g], load);
+            group_sum[g] += load;
+            group_heat[g] += heat;
+            group_n[g]++;
+        }
+        for (size_t g = 0; g < groupc && len < outsize; g++) {
+            if (group_n[g]) {
+                len += draw(g, buf + len, outsize - len, group_sum[g] / group_n[g],
+                        group_heat[g] / group_n[g], group_lo[g], group_hi[g]);
+            }
+        }
+    }
+    if (len >= outsize) {
+        fprintf(stderr, "dwmbcpul: output truncated\n");
+        len = outsize - 1;
+    }
+    if (len == outlen && !memcmp(buf, out, len)) {
+        return;
+    }
+
+    int fd;
+    syscalls++;
+    if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        perror("dwmbcpul: failed to open output file");
+        return;
+    }
+    int err = write(fd, buf, len) != (ssize_t)len;
+    syscalls += 3;
+    if (close(fd) || err || rename(tmppath, fpath)) {
+        perror("dwmbcpul: failed to write output file");
+        unlink(tmppath);
+        return;
+    }
+    outbuf = out;
+    out = buf;
+    outlen = len;
+    if (dwmb_pid) {
+        kill(dwmb_pid, SIGRTMIN + DWMB_SIG);
+        syscalls++;
+    }
+}
+
+/* Gather everything over the last interval and send it */
+void update()
+{
+    tis_update();
+    if (stat_fd != -1 && stat_update()) {
+        fprintf(stderr, "dwmbcpul: failed to parse /proc/stat\n");
+    }
+    if (avgl_fd != -1 && read_value(avgl_fd, 2, &avgload)) {
+        fprintf(stderr, "dwmbcpul: failed to parse loadavg\n");
+    }
+    windows_update();
+    send();
+    for (size_t i = 0; i < corec; i++) {
+        cores[i] = 0;
+        readc[i] = 0;
+    }
+}
+
+/* Measure how late the wakeups of a second of READFREQ ticks are, then
+ * time sampling ticks and sending ticks run flat out, up to ticks of
+ * each or a second, and print the results. Every tick also waits for
+ * the timer, so the syscalls of a wait are added to its count. */
+int bench(long ticks)
+{
+    uint64_t s0, t0, t1;
+    long n;
+    dwmb_pid = 0;
+    printf("policies\t%zu\ncpus\t%zu\nbars\t%zu\nsampled policies\t",
+            corec, ncpus, groupc? groupc : unitc());
+    size_t sampled = 0;
+    for (size_t i = 0; i < corec; i++) {
+        sampled += core_fd[i] != -1 && tis_fd[i] == -1;
+    }
+    printf("%zu\n", sampled);
 
-        // Append core bars
-        if ((file = fopen(fpath, "a")) != NULL) {
-            float max_h = BARH - (2 * PAD);
-            for (size_t i = 0; i < corec; i++) {
-                char col[8];
-                float load = (float)(cores[i] / cores_max[i] / readc[i]);
-                sprintf(col, "#%02x%02x00", (int)(180 + (load * 75)), (int)(255 - (load * 255)));
-                col[7] = '\0';
-                int h = (int)(max_h * load);
-                int y = BARH - PAD - h;
-                fprintf(file, "^c%s^^r0,%d,2,%d^^f3^", col, y, h);
+    uint64_t next = now_ns(), late, sum = 0, worst = 0;
+    s0 = syscalls;
+    for (int i = 0; i < READFREQ; i++) {
+        next += NSEC / READFREQ;
+        sleep_until(next);
+        late = now_ns() - next;
+        sum += late;
+        worst = MAX(worst, late);
+    }
+    double wait = (double)(syscalls - s0) / READFREQ;
+    printf("wakeup jitter\t%.1f us mean\t%.1f us max\t%.2f syscalls\n",
+            sum / 1e3 / READFREQ, worst / 1e3, wait);
+
+    s0 = syscalls;
+    t0 = t1 = now_ns();
+    for (n = 0; n < ticks && t1 - t0 < NSEC; n++) {
+        sample(1);
+        t1 = now_ns();
+    }
+    printf("sample tick\t%.3f us\t%.2f syscalls\n", (t1 - t0) / 1e3 / n,
+            (double)(syscalls - s0) / n + wait);
+
+    // Unchanged output is the common case, a changed one costs an open,
+    // write, close and rename more, and a kill when started by dwmblocks
+    for (int changed = 0; changed < 2; changed++) {
+        s0 = syscalls;
+        t0 = t1 = now_ns();
+        for (n = 0; n < ticks && t1 - t0 < NSEC; n++) {
+            if (changed) {
+                outlen = 0;
             }
-            fclose(file);
+            update();
+            t1 = now_ns();
         }
+        printf("send tick, %s\t%.3f us\t%.2f syscalls\n", changed? "changed" : "unchanged",
+                (t1 - t0) / 1e3 / n, (double)(syscalls - s0) / n + wait);
     }
+    cleanup();
+    return EXIT_SUCCESS;
 }
 
 void termhandler(int signum)
@@ -109,30 +910,63 @@ void termhandler(int signum)
 
 void cleanup()
 {
-    if (avgl_file) {
-        fclose(avgl_file);
+    if (bench_file) {
+        unlink(fpath);
+        unlink(tmppath);
+    }
+    if (avgl_fd != -1) {
+        close(avgl_fd);
     }
-    for (size_t i = 0; i < sizeof core_file / sizeof *core_file; i++) {
-        if (core_file[i]) {
-            fclose(core_file[i]);
+    if (stat_fd != -1) {
+        close(stat_fd);
+    }
+    if (timer_fd != -1) {
+        close(timer_fd);
+    }
+    for (size_t i = 0; i < corec && core_fd && tis_fd; i++) {
+        if (core_fd[i] != -1) {
+            close(core_fd[i]);
+        }
+        if (tis_fd[i] != -1) {
+            close(tis_fd[i]);
         }
     }
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+    long bench_ticks = 0;
+    if (argc > 1 && !strcmp(argv[1], "--bench") && argc <= 3) {
+        bench_ticks = argc == 3? atol(argv[2]) : BENCH_TICKS;
+    }
+    if (argc > 1 && bench_ticks <= 0) {
+        fprintf(stderr, "usage: dwmbcpul [--bench [ticks]]\n");
+        return EXIT_FAILURE;
+    }
+    if (getenv(ROOT_ENV)) {
+        root = getenv(ROOT_ENV);
+    }
+
     signal(SIGTERM, termhandler);
     signal(SIGINT, termhandler);
     prctl(PR_SET_PDEATHSIG, SIGTERM);
 
+#ifdef SHOW_SIG
+    // Kept pending until waited for, so a change is never missed
+    sigset_t showset;
+    sigemptyset(&showset);
+    sigaddset(&showset, SIGRTMIN + SHOW_SIG);
+    sigprocmask(SIG_BLOCK, &showset, NULL);
+#endif
+
     /* initialize shared memory */
-    sharedmemoryfd = shm_open(SHM_NAME, O_RDWR, S_IRWXU|S_IRWXG);
-    if (sharedmemoryfd < 0) {
+    sharedmemoryfd = bench_ticks? -1 : shm_open(SHM_NAME, O_RDWR, S_IRWXU|S_IRWXG);
+    if (sharedmemoryfd < 0 && !bench_ticks) {
         perror("dwmblocks: failed to open shared memory");
         return EXIT_FAILURE;
     }
-    sharedmemory = (char*)mmap(NULL, MAX(SHOW_BAR_BYTE, SHOW_STATUS_BYTE), PROT_READ|PROT_WRITE, MAP_SHARED, sharedmemoryfd, 0);
-    if (sharedmemory == NULL) {
+    sharedmemory = bench_ticks? NULL : (char*)mmap(NULL, MAX(SHOW_BAR_BYTE, SHOW_STATUS_BYTE), PROT_READ|PROT_WRITE, MAP_SHARED, sharedmemoryfd, 0);
+    if (sharedmemory == NULL && !bench_ticks) {
         fprintf(stderr, "dwmblocks: failed to run mmap");
         return EXIT_FAILURE;
     }
@@ -141,88 +975,243 @@ int main(void)
     // Construct destination file path
     const char *destdir = getenv("TMPDIR");
     if (destdir) {
-        sprintf(fpath, "%s/%s", destdir, HIST_FILE);
+        snprintf(fpath, sizeof fpath, "%s/%s", destdir, HIST_FILE);
     } else {
         sprintf(fpath, "/tmp/%s", HIST_FILE);
     }
+    if (bench_ticks) {
+        // A private file, so that a running instance's is left alone
+        int fd;
+        if (strlen(fpath) + 8 > sizeof fpath) {
+            fprintf(stderr, "dwmbcpul: TMPDIR too long\n");
+            return EXIT_FAILURE;
+        }
+        strcat(fpath, ".XXXXXX");
+        if ((fd = mkstemp(fpath)) == -1) {
+            fprintf(stderr, "dwmbcpul: failed to create %s\n", fpath);
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        bench_file = 1;
+    }
+    snprintf(tmppath, sizeof tmppath, "%s.tmp", fpath);
+
+    // The update signal would kill anything but dwmblocks
+    {
+        char fp[100], comm[32];
+        int fd;
+        ssize_t len = 0;
+        snprintf(fp, sizeof fp, "/proc/%d/comm", (int)getppid());
+        if ((fd = open(fp, O_RDONLY)) != -1) {
+            len = pread(fd, comm, sizeof comm, 0);
+            close(fd);
+        }
+        if (len == sizeof DWMB_NAME && !memcmp(comm, DWMB_NAME "\n", len)) {
+            dwmb_pid = getppid();
+        }
+    }
+
+    // Size the per CPU tables for every CPU that may come online
+    long conf = sysconf(_SC_NPROCESSORS_CONF);
+    ncpus = conf > 0? conf : 1;
+    char fp[PATH_SIZE];
+#ifdef UTILIZATION
+    root_path(fp, sizeof fp, "/proc/stat");
+    if ((stat_fd = open(fp, O_RDONLY)) == -1) {
+        die("failed to open /proc/stat");
+    }
+    ncpus = MAX(ncpus, stat_cpus());
+#endif
+    stat_busy = xcalloc(ncpus + 1, sizeof *stat_busy);
+    stat_total = xcalloc(ncpus + 1, sizeof *stat_total);
+    util = xcalloc(ncpus + 1, sizeof *util);
+    cpu_policy = xcalloc(ncpus, sizeof *cpu_policy);
+    for (size_t i = 0; i < ncpus; i++) {
+        cpu_policy[i] = -1;
+    }
 
-    // Get paths to all CPU cores
+    // Get paths to all CPU cores, and size the per policy tables
     glob_t pglob;
-    if (glob("/sys/devices/system/cpu/cpufreq/policy*", GLOB_ONLYDIR, NULL, &pglob)) {
+    root_path(fp, sizeof fp, "/sys/devices/system/cpu/cpufreq/policy*");
+    int gerr = glob(fp, GLOB_ONLYDIR, NULL, &pglob);
+#ifdef UTILIZATION
+    // Without cpufreq (e.g. in a VM) the bars are just colored by load
+    if (gerr == GLOB_NOMATCH) {
+        gerr = 0;
+        pglob.gl_pathc = 0;
+        pglob.gl_pathv = NULL;
+    }
+#endif
+    if (gerr) {
         die("glob failed");
     }
-    corec = pglob.gl_pathc;
+    size_t n = pglob.gl_pathc;
+    core_fd = xcalloc(n, sizeof *core_fd);
+    cores = xcalloc(n, sizeof *cores);
+    cur_khz = xcalloc(n, sizeof *cur_khz);
+    cores_max = xcalloc(n, sizeof *cores_max);
+    tis_fd = xcalloc(n, sizeof *tis_fd);
+    tis_ft = xcalloc(n, sizeof *tis_ft);
+    tis_t = xcalloc(n, sizeof *tis_t);
+    readc = xcalloc(n, sizeof *readc);
+    policy_cpu = xcalloc(n, sizeof *policy_cpu);
+    for (size_t i = 0; i < n; i++) {
+        core_fd[i] = tis_fd[i] = policy_cpu[i] = -1;
+    }
+    corec = n;
 
-    // Get maximum clock speeds and cache file pointers
+    // Get maximum clock speeds and keep the current frequency files open
     for (size_t i = 0; i < corec; i++) {
-        FILE *file;
-        char fp[100];
-        strcpy(fp, pglob.gl_pathv[i]);
-        strcat(fp, "/scaling_max_freq");
-        fp[99] = '\0';
-        if ((file = fopen(fp, "r")) != NULL) {
-            int ret = fscanf(file, "%Lf", &cores_max[i]);
-            if (!ret || ret == EOF) {
+        int fd;
+        snprintf(fp, sizeof fp, "%s/related_cpus", pglob.gl_pathv[i]);
+        if ((fd = open(fp, O_RDONLY)) != -1) {
+            read_cpus(fd, i);
+            close(fd);
+        }
+#ifdef FREQUENCY
+        snprintf(fp, sizeof fp, "%s/scaling_max_freq", pglob.gl_pathv[i]);
+        if ((fd = open(fp, O_RDONLY)) != -1) {
+            if (read_value(fd, 0, &cores_max[i])) {
                 die("failed to read scaling_max_freq");
             }
-            fclose(file);
+            close(fd);
+        }
+#ifdef TIME_IN_STATE
+        snprintf(fp, sizeof fp, "%s/stats/time_in_state", pglob.gl_pathv[i]);
+        if ((tis_fd[i] = open(fp, O_RDONLY)) != -1
+                && read_tis(tis_fd[i], &tis_ft[i], &tis_t[i])) {
+            close(tis_fd[i]);
+            tis_fd[i] = -1;
         }
-        strcpy(fp, pglob.gl_pathv[i]);
-        strcat(fp, "/scaling_cur_freq");
-        if ((core_file[i] = fopen(fp, "r")) == NULL) {
+#endif
+        snprintf(fp, sizeof fp, "%s/scaling_cur_freq", pglob.gl_pathv[i]);
+        if ((core_fd[i] = open(fp, O_RDONLY)) == -1) {
             perror("dwmbcpul: failed to open core file: ");
         }
+        sampling |= tis_fd[i] == -1;
+#endif
+    }
+    if (n) {
+        globfree(&pglob);
     }
 
-    // Cache avgload file pointer
-    if ((avgl_file = fopen("/proc/loadavg", "r")) == NULL) {
+#ifdef UTILIZATION
+    // Keep /proc/stat open, the first reading is the baseline
+    if (stat_update()) {
+        die("failed to read /proc/stat");
+    }
+#else
+    // Keep the avgload file open
+    root_path(fp, sizeof fp, "/proc/loadavg");
+    if ((avgl_fd = open(fp, O_RDONLY)) == -1) {
         perror("dwmbcpul: failed to open loadavg file: ");
     }
+#endif
 
-    int n = 0;
-    while (1) {
-        if (SHOW_STATUS) {
-            int ret;
-
-            // Get current overall average load
-            if (avgl_file) {
-                rewind(avgl_file);
-                ret = fscanf(avgl_file, "%f", &avgload);
-                if (!ret || ret == EOF) {
-                    perror("dwmbcpul: failed to parse loadavg: ");
-                }
-                avgload /= corec;
-                fflush(avgl_file);
+    // Group units when there are too many bars or it is asked for
+#ifdef UTILIZATION
+    unitcap = ncpus;
+#else
+    unitcap = corec;
+#endif
+    unit_group = xcalloc(unitcap, sizeof *unit_group);
+    if (GROUP == GROUP_AUTO && unitc() > MAX_BARS) {
+        // Groupings no CPU has keys for are skipped, and the fewest bars win
+        int best = GROUP_NONE;
+        for (int by = GROUP_POLICY; by <= GROUP_NODE && (!groupc || groupc > MAX_BARS); by++) {
+            size_t n = make_groups(by);
+            if (n && (!groupc || n < groupc)) {
+                groupc = n;
+                best = by;
             }
+        }
+        if (best != GROUP_NONE) {
+            groupc = make_groups(best);
+        }
+    } else if (GROUP != GROUP_NONE && GROUP != GROUP_AUTO) {
+        groupc = make_groups(GROUP);
+    }
+    group_lo = xcalloc(groupc, sizeof *group_lo);
+    group_hi = xcalloc(groupc, sizeof *group_hi);
+    group_sum = xcalloc(groupc, sizeof *group_sum);
+    group_heat = xcalloc(groupc, sizeof *group_heat);
+    group_n = xcalloc(groupc, sizeof *group_n);
+    windows = xcalloc(unitcap, sizeof *windows);
+#ifdef SPARKLINE
+    sparks = xcalloc(unitcap, sizeof *sparks);
+    for (size_t i = 0; i < unitcap; i++) {
+        spark_clear(&sparks[i]);
+    }
+#endif
+    outsize = 128 + BAR_SIZE * unitcap;
+    out = xcalloc(outsize, 1);
+    outbuf = xcalloc(outsize, 1);
 
-            // Get current clock speeds
-            for (size_t i = 0; i < corec; i++) {
-                if (core_file[i]) {
-                    rewind(core_file[i]);
-                    long double hz;
-                    ret = fscanf(core_file[i], "%Lf", &hz);
-                    if (!ret || ret == EOF) {
-                        perror("dwmbcpul: failed to parse scaling_cur_freq: ");
-                        continue;
-                    }
-                    cores[i] += hz;
-                    readc[i]++;
-                    fflush(core_file[i]);
-                }
-            }
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+        die("failed to create timerfd");
+    }
+    if (bench_ticks) {
+        return bench(bench_ticks);
+    }
 
-            // Every READFREQ'th iteration send results to dwmblocks
-            if (!(++n % READFREQ)) {
-                send();
+    // With time_in_state for every core one reading per second is exact,
+    // otherwise the remaining cores are sampled between READFREQ_MIN and
+    // READFREQ times a second. Ticks are on absolute deadlines, and
+    // results are sent on the same whole seconds whatever the rate.
+    unsigned rate = READFREQ;
+    uint64_t last = now_ns(), next = last, next_send = last + NSEC;
+    int hidden = 0;
+    while (1) {
+        if (SHOW_STATUS) {
+            if (hidden) {
+                // Averages must not span the time spent hidden
+                tis_update();
+                if (stat_fd != -1) {
+                    stat_update();
+                }
                 for (size_t i = 0; i < corec; i++) {
                     cores[i] = 0;
                     readc[i] = 0;
                 }
+                memset(windows, 0, sizeof *windows * unitcap);
+#ifdef SPARKLINE
+                for (size_t i = 0; i < unitcap; i++) {
+                    spark_clear(&sparks[i]);
+                }
+#endif
+                last = next = now_ns();
+                next_send = next + NSEC;
+                hidden = 0;
+            }
+
+            // Get current clock speeds, and speed up as soon as they
+            // change but slow down only gradually
+            if (sampling) {
+                unsigned change = sample(MAX((next - last) / 1000000, 1));
+                rate = change > STABLE? READFREQ : MAX(rate / 2, READFREQ_MIN);
             }
 
-            usleep(1000000 / READFREQ);
+            // Send results to dwmblocks once a second
+            if (next >= next_send) {
+                update();
+                next_send += NSEC;
+            }
+
+            // Skip the deadlines that were missed rather than catch up
+            uint64_t t = now_ns();
+            if (next_send < t) {
+                next_send = t + NSEC;
+            }
+            last = next;
+            next = sampling? MIN(MAX(next + NSEC / rate, t), next_send) : next_send;
+            sleep_until(next);
         } else {
+            hidden = 1;
+#ifdef SHOW_SIG
+            sigtimedwait(&showset, NULL, &(struct timespec){ .tv_sec = SHOW_POLL });
+#else
             usleep(1000000 / 2);
+#endif
         }
     }
 
@@ -0,0 +1,224 @@
+/* Benchmark harness: runs every engine over a set of standard rulesets
+ * and iteration counts, discarding the output, and prints one
+ * tab-separated line per iteration and per run:
+ *
+ *   ruleset engine iterations iteration seconds symbols symbols/s reallocs peak_rss_kib
+ *
+ * Iteration lines (only reported by the in-memory engines) have the
+ * iteration number, the time it took and the length after it; run
+ * lines have "all" and the totals. Peak RSS is reset before every run
+ * where the kernel allows it, and is "-" on iteration lines.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "lsystem.h"
+#include "output.h"
+#include "rules.h"
+#include "slp.h"
+
+#define MAX_RULES 8
+#define MAX_COUNTS 8
+#define CACHE_SIZE (64 << 20)
+
+typedef struct {
+    const char *name;
+    const char *rules[MAX_RULES];
+    const char *axiom;
+    int iters[MAX_COUNTS];      /* 0-terminated */
+} Ruleset;
+
+static const Ruleset rulesets[] = {
+    {"default", {"a -> bc", "b -> a", "c -> ba"}, "a", {24, 28, 32, 36}},
+    {"fibonacci", {"a -> ab", "b -> a"}, "a", {24, 28, 32, 36}},
+    {"dragon", {"X -> X+YF+", "Y -> -FX-Y"}, "FX", {12, 16, 20, 24}},
+    {"hilbert", {"A -> +BF-AFA-FB+", "B -> -AF+BFB-FA-"}, "A", {4, 6, 8, 10}},
+    {"stochastic", {"F (2) -> F[+F]F", "F -> F[-F]F", "F < F > [ -> G"}, "F", {6, 9, 12}},
+};
+
+enum { MEMORY, SCALAR, STREAM, CACHE, GRAMMAR };
+
+static const char *engines[] = {"memory", "scalar", "stream", "cache", "grammar"};
+
+static size_t out_bytes;
+static double iter_start;
+static const char *cur_ruleset, *cur_engine;
+static int cur_iters;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void discard(const char *src, size_t n)
+{
+    (void)src;
+    out_bytes += n;
+}
+
+static void on_iteration(int iter, size_t len)
+{
+    double t = now(), dt = t - iter_start;
+    printf("%s\t%s\t%d\t%d\t%.6f\t%zu\t%.0f\t%zu\t-\n", cur_ruleset, cur_engine,
+            cur_iters, iter, dt, len, dt > 0? len / dt : 0, realloc_count);
+    iter_start = t;
+}
+
+/* Reset the peak RSS, returning nonzero if the kernel does not allow it */
+static int rss_reset()
+{
+    FILE *f;
+    if (!(f = fopen("/proc/self/clear_refs", "w"))) {
+        return 1;
+    }
+    int err = fputs("5", f) < 0;
+    return fclose(f) || err;
+}
+
+/* Peak RSS in KiB since the last reset, or of the whole process */
+static long rss_peak(int since_reset)
+{
+    char line[256];
+    long kib = -1;
+    FILE *f;
+    if (since_reset && (f = fopen("/proc/self/status", "r"))) {
+        while (fgets(line, sizeof line, f)) {
+            if (sscanf(line, "VmHWM: %ld", &kib) == 1) {
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if (kib < 0) {
+        struct rusage ru;
+        kib = getrusage(RUSAGE_SELF, &ru)? 0 : ru.ru_maxrss;
+    }
+    return kib;
+}
+
+static int run(const Ruleset *rs, int engine, int iters)
+{
+    int ret = 0;
+    for (int i = 0; i < MAX_RULES && rs->rules[i] && !ret; i++) {
+        ret = rules_parse(rs->rules[i], rs->name, i + 1);
+    }
+    void *axiom = NULL;
+    size_t len;
+    if (ret || (ret = rules_compile(rs->axiom, &axiom, &len))) {
+        rules_free();
+        return ret;
+    }
+    if (rules_complex && engine != MEMORY) {
+        free(axiom);
+        rules_free();
+        return 0;
+    }
+    const Engine *e = sym_width == 1? &engine8 : &engine16;
+
+    cur_ruleset = rs->name;
+    cur_engine = engines[engine];
+    cur_iters = iters;
+    out_bytes = 0;
+    realloc_count = 0;
+    use_simd = engine != SCALAR;
+    iter_hook = engine == MEMORY || engine == SCALAR? on_iteration : NULL;
+    int since_reset = !rss_reset();
+    double start = iter_start = now();
+    switch (engine) {
+        case MEMORY:
+        case SCALAR: ret = e->iterate(axiom, len, iters); break;
+        case STREAM: ret = e->stream(axiom, len, iters); break;
+        case CACHE: ret = e->stream_memo(axiom, len, iters, CACHE_SIZE); break;
+        case GRAMMAR:
+            if (!(ret = slp_build(axiom, len, iters))) {
+                ret = slp_stream();
+            }
+            break;
+    }
+    double dt = now() - start;
+    long rss = rss_peak(since_reset);
+    e->cleanup();
+    slp_free();
+    free(axiom);
+    rules_free();
+    if (!ret) {
+        /* the trailing newline is not a symbol */
+        size_t syms = out_bytes - 1;
+        printf("%s\t%s\t%d\tall\t%.6f\t%zu\t%.0f\t%zu\t%ld\n", rs->name, engines[engine],
+                iters, dt, syms, dt > 0? syms / dt : 0, realloc_count, rss);
+    }
+    fflush(stdout);
+    return ret;
+}
+
+static int selected(const char *name, char **list, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (!strcmp(name, list[i])) {
+            return 1;
+        }
+    }
+    return !n;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: lsystem-bench [-r ruleset]... [-e engine]... [-j threads]\n"
+            "  rulesets: default fibonacci dragon hilbert stochastic\n"
+            "  engines:  memory scalar stream cache grammar\n");
+}
+
+int main(int argc, char **argv)
+{
+    char *rs_sel[argc], *eng_sel[argc];
+    int nrs = 0, neng = 0, opt;
+    seed = 1;
+    while ((opt = getopt(argc, argv, "r:e:j:")) != -1) {
+        switch (opt) {
+            case 'r': rs_sel[nrs++] = optarg; break;
+            case 'e': eng_sel[neng++] = optarg; break;
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads <= 0) {
+                    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    nthreads = nthreads < 1? 1 : MAX_THREADS;
+                }
+                break;
+            default: usage(); return 1;
+        }
+    }
+    if (optind != argc) {
+        usage();
+        return 1;
+    }
+
+    out_sink = discard;
+    printf("ruleset\tengine\titerations\titeration\tseconds\tsymbols\tsymbols/s"
+            "\treallocs\tpeak_rss_kib\n");
+    for (size_t i = 0; i < sizeof rulesets / sizeof *rulesets; i++) {
+        const Ruleset *rs = &rulesets[i];
+        if (!selected(rs->name, rs_sel, nrs)) {
+            continue;
+        }
+        for (int e = 0; e < (int)(sizeof engines / sizeof *engines); e++) {
+            if (!selected(engines[e], eng_sel, neng)) {
+                continue;
+            }
+            for (int j = 0; j < MAX_COUNTS && rs->iters[j]; j++) {
+                int ret;
+                if ((ret = run(rs, e, rs->iters[j]))) {
+                    return ret;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bignum.h"
+
+static int reserve(Bignum *a, size_t cap)
+{
+    if (cap <= a->cap) {
+        return 0;
+    }
+    uint32_t *d;
+    if (!(d = realloc(a->d, sizeof *d * cap))) {
+        return 1;
+    }
+    memset(d + a->cap, 0, sizeof *d * (cap - a->cap));
+    a->d = d;
+    a->cap = cap;
+    return 0;
+}
+
+void bn_init(Bignum *a)
+{
+    a->d = NULL;
+    a->n = a->cap = 0;
+}
+
+void bn_free(Bignum *a)
+{
+    free(a->d);
+    bn_init(a);
+}
+
+int bn_set(Bignum *a, uint32_t val)
+{
+    if (reserve(a, 1)) {
+        return 1;
+    }
+    memset(a->d, 0, sizeof *a->d * a->cap);
+    a->d[0] = val;
+    a->n = val != 0;
+    return 0;
+}
+
+int bn_addmul(Bignum *r, const Bignum *a, const Bignum *b)
+{
+    if (!a->n || !b->n) {
+        return 0;
+    }
+    size_t n = (r->n > a->n + b->n? r->n : a->n + b->n) + 1;
+    if (reserve(r, n)) {
+        return 1;
+    }
+    for (size_t i = 0; i < a->n; i++) {
+        uint64_t carry = 0;
+        size_t j;
+        for (j = 0; j < b->n; j++) {
+            uint64_t t = r->d[i + j] + (uint64_t)a->d[i] * b->d[j] + carry;
+            r->d[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        for (j += i; carry; j++) {
+            uint64_t t = r->d[j] + carry;
+            r->d[j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+    }
+    while (n && !r->d[n - 1]) {
+        n--;
+    }
+    r->n = n;
+    return 0;
+}
+
+char *bn_str(const Bignum *a)
+{
+    /* every base 2^32 digit takes at most 10 decimal digits */
+    char *str, *p;
+    uint32_t *tmp;
+    if (!(str = malloc(a->n * 10 + 2))) {
+        return NULL;
+    }
+    p = str + a->n * 10 + 1;
+    *p = '\0';
+    if (!a->n) {
+        *--p = '0';
+        memmove(str, p, 2);
+        return str;
+    }
+    if (!(tmp = malloc(sizeof *tmp * a->n))) {
+        free(str);
+        return NULL;
+    }
+    memcpy(tmp, a->d, sizeof *tmp * a->n);
+    size_t n = a->n;
+    while (n) {
+        /* divide by 10^9 and print the remainder as 9 digits */
+        uint64_t rem = 0;
+        for (size_t i = n; i--;) {
+            uint64_t cur = (rem << 32) | tmp[i];
+            tmp[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        while (n && !tmp[n - 1]) {
+            n--;
+        }
+        for (int i = 0; i < 9 && (n || rem); i++) {
+            *--p = '0' + rem % 10;
+            rem /= 10;
+        }
+    }
+    free(tmp);
+    memmove(str, p, strlen(p) + 1);
+    return str;
+}
@@ -0,0 +1,29 @@
+/* Minimal arbitrary-precision unsigned integers, just enough for
+ * multiplying matrices of symbol counts and printing the result.
+ * Functions that allocate return nonzero when out of memory. */
+#ifndef BIGNUM_H
+#define BIGNUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t *d;    /* little-endian base 2^32 digits */
+    size_t n, cap;  /* n == 0 means the number is 0 */
+} Bignum;
+
+/* initialize to 0 */
+void bn_init(Bignum *a);
+
+void bn_free(Bignum *a);
+
+/* set a to a small value */
+int bn_set(Bignum *a, uint32_t val);
+
+/* r += a * b (r must not be a or b) */
+int bn_addmul(Bignum *r, const Bignum *a, const Bignum *b);
+
+/* return a newly allocated decimal representation, or NULL */
+char *bn_str(const Bignum *a);
+
+#endif /* BIGNUM_H */
@@ -0,0 +1,9 @@
+# general config
+CC = cc
+CFLAGS = -std=gnu99 -Wall -Wextra -pedantic -O3 -pthread
+
+LD = cc
+LDFLAGS = -pthread -lm
+
+OBJS = lsystem.o bignum.o engine8.o engine16.o output.o rules.o simd.o slp.o turtle.o
+BENCH_OBJS = bench.o engine8.o engine16.o output.o rules.o simd.o slp.o
@@ -0,0 +1,757 @@
+/* Rewriting engines, compiled once per symbol ID width: with
+ * SYM_BITS=8 this defines engine8 and with SYM_BITS=16 engine16.
+ * Strings are arrays of Sym with their lengths kept separately, and
+ * are only turned into text by emit() on the way out. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "lsystem.h"
+#include "output.h"
+#include "rules.h"
+#include "simd.h"
+
+#if SYM_BITS == 8
+typedef uint8_t Sym;
+#define ENGINE engine8
+#elif SYM_BITS == 16
+typedef uint16_t Sym;
+#define ENGINE engine16
+#else
+#error "SYM_BITS must be 8 or 16"
+#endif
+
+#define PAR_MIN 0x100000        /* shorter strings are not worth splitting */
+#define BLOCK 0x1000            /* symbols sharing one random number stream */
+#define START_SIZE 0xffff
+#define SEGMENT 0x1000000       /* symbols of the last iteration written out at once */
+
+#if SYM_BITS == 8
+/* settings shared by both builds live in this one */
+int nthreads = 1;
+int use_simd;
+uint64_t seed;
+void (*iter_hook)(int iter, size_t len);
+size_t realloc_count;
+#endif
+
+static Sym *str, *new_str;
+static size_t size;
+
+/* A pending rule body during depth-first expansion */
+typedef struct {
+    const Sym *pos, *end;
+    int depth;
+} Frame;
+
+/* A slice of the current string handled by one thread */
+typedef struct {
+    const Sym *src, *end;
+    Sym *dest;
+    const Sym *limit;       /* end of the space dest may be written to */
+    size_t len;
+    unsigned char *sel;     /* chosen alternative for every symbol of src */
+    uint64_t seed;
+} Chunk;
+
+/* lens[k * lens_w + lens_col[c]] is the length of symbol c after k
+ * iterations, or LEN_OVERFLOW if that does not fit in a size_t. Only
+ * symbols reachable from the axiom get a column, and rows stop at
+ * lens_top, after which every length stays the same; see len_at(). */
+static size_t *lens, *lens_col, lens_w;
+static int lens_top;
+static Sym *lens_sym;       /* the symbol of every column */
+
+/* memo[k * lens_w + lens_col[c]] is the cached expansion of c after k
+ * iterations, for k up to memo_depth */
+static Sym **memo;
+static int memo_depth;
+static size_t memo_left;
+
+/* State of the stochastic and context-sensitive engine */
+static unsigned char *sel;
+static const Sym *cur_lo, *cur_hi;
+
+/* Write n symbols as text */
+static void emit(const Sym *src, size_t n)
+{
+#if SYM_BITS == 8
+    if (sym_bytes) {
+        out_put((const char*)src, n);
+        return;
+    }
+#endif
+    for (const Sym *end = src + n; src != end; src++) {
+        out_put(sym_text[*src], strlen(sym_text[*src]));
+    }
+}
+
+static int srealloc(size_t new_size)
+{
+    realloc_count++;
+    size = new_size;
+    if (!(str = realloc(str, sizeof(Sym) * size))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    if (!(new_str = realloc(new_str, sizeof(Sym) * size))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    if (sel && !(sel = realloc(sel, size))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    return 0;
+}
+
+static int alloc(size_t min_size)
+{
+    size = min_size;
+    if (!(str = malloc(sizeof(Sym) * size))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    if (!(new_str = malloc(sizeof(Sym) * size))) {
+        fprintf(stderr, "out of memory\n");
+        free(str);
+        str = NULL;
+        return 2;
+    }
+    return 0;
+}
+
+/* Give every symbol reachable from the axiom a column of lens[] */
+static int lens_columns(const Sym *axiom, size_t len)
+{
+    Sym *syms;
+    if (!(lens_col = malloc(sizeof *lens_col * nsyms)) || !(syms = lens_sym = malloc(sizeof *syms * nsyms))) {
+        return 2;
+    }
+    for (size_t c = 0; c < nsyms; c++) {
+        lens_col[c] = LEN_OVERFLOW;
+    }
+    lens_w = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (lens_col[axiom[i]] == LEN_OVERFLOW) {
+            lens_col[axiom[i]] = lens_w;
+            syms[lens_w++] = axiom[i];
+        }
+    }
+    for (size_t i = 0; i < lens_w; i++) {
+        const Rule *r = &rules[syms[i]];
+        const Sym *val = r->val;
+        for (size_t j = 0; j < r->len && !r->identity; j++) {
+            if (lens_col[val[j]] == LEN_OVERFLOW) {
+                lens_col[val[j]] = lens_w;
+                syms[lens_w++] = val[j];
+            }
+        }
+    }
+    return 0;
+}
+
+/* Fill lens[] for 0..iters iterations using the recurrence
+ * len(c, k) = sum of len(d, k - 1) over every d in the rule for c.
+ * Once a row equals the one before, so do all the later ones. */
+static int lens_compute(const Sym *axiom, size_t len, int iters)
+{
+    const Sym *syms;
+    size_t rows = 16;
+    if (lens_columns(axiom, len) || !(lens = malloc(sizeof *lens * MAX(lens_w, 1) * rows))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    for (size_t i = 0; i < lens_w; i++) {
+        lens[i] = 1;
+    }
+    syms = lens_sym;
+    for (lens_top = 0; lens_top < iters; lens_top++) {
+        if ((size_t)lens_top + 1 == rows) {
+            size_t *tmp;
+            if (rows > LEN_OVERFLOW / 2 / MAX(lens_w, 1) / sizeof *lens
+                    || !(tmp = realloc(lens, sizeof *lens * MAX(lens_w, 1) * (rows *= 2)))) {
+                fprintf(stderr, "out of memory\n");
+                return 2;
+            }
+            lens = tmp;
+        }
+        const size_t *prev = lens + (size_t)lens_top * lens_w;
+        size_t *cur = lens + (size_t)(lens_top + 1) * lens_w;
+        for (size_t i = 0; i < lens_w; i++) {
+            const Rule *r = &rules[syms[i]];
+            const Sym *val = r->val;
+            if (r->identity) {
+                cur[i] = 1;
+                continue;
+            }
+            size_t l = 0;
+            for (size_t j = 0; j < r->len; j++) {
+                l = add_len(l, prev[lens_col[val[j]]]);
+            }
+            cur[i] = l;
+        }
+        if (!memcmp(prev, cur, sizeof *lens * lens_w)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Length of c after k iterations, for c reachable from the axiom */
+static size_t len_at(Sym c, int k)
+{
+    return lens[(size_t)MIN(k, lens_top) * lens_w + lens_col[c]];
+}
+
+/* Length of the axiom after k iterations, computed from per-symbol counts. */
+static size_t axiom_len(const size_t *counts, int k)
+{
+    size_t l = 0;
+    for (size_t c = 0; c < nsyms; c++) {
+        if (counts[c]) {
+            l = add_len(l, mul_len(counts[c], len_at(c, k)));
+        }
+    }
+    return l;
+}
+
+static void *chunk_count(void *arg)
+{
+    Chunk *c = arg;
+    size_t len = 0;
+    for (const Sym *let = c->src; let != c->end; let++) {
+        len += rules[*let].len;
+    }
+    c->len = len;
+    return NULL;
+}
+
+static void *chunk_copy(void *arg)
+{
+    Chunk *c = arg;
+    Sym *dest = c->dest;
+    const Sym *let = c->src;
+#if SYM_BITS == 8
+    if (use_simd) {
+        let = simd_expand(let, c->end, (char**)&dest, (const char*)c->limit);
+    }
+#endif
+    for (; let != c->end; let++) {
+        const Rule *r = &rules[*let];
+        memcpy(dest, r->val, sizeof(Sym) * r->len);
+        dest += r->len;
+    }
+    c->len = dest - c->dest;
+    return NULL;
+}
+
+/* Run fn on every chunk, one thread each. The calling thread takes the
+ * first chunk, and any chunk whose thread fails to start is done inline. */
+static void run_chunks(void *(*fn)(void*), Chunk *chunks, int n)
+{
+    pthread_t tids[MAX_THREADS];
+    int started[MAX_THREADS];
+    for (int i = 1; i < n; i++) {
+        started[i] = !pthread_create(&tids[i], NULL, fn, &chunks[i]);
+    }
+    fn(&chunks[0]);
+    for (int i = 1; i < n; i++) {
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        } else {
+            fn(&chunks[i]);
+        }
+    }
+}
+
+/* Split len symbols of src into chunks for at most nthreads threads.
+ * Chunks start at multiples of BLOCK, so that random choices do not
+ * depend on the number of threads. Returns the number of chunks. */
+static int split(Chunk *chunks, const Sym *src, size_t len)
+{
+    int n = (size_t)nthreads > len / PAR_MIN? (int)(len / PAR_MIN) : nthreads;
+    if (n < 1) {
+        n = 1;
+    }
+    size_t step = (len / n + BLOCK - 1) / BLOCK * BLOCK;
+    for (int i = 0; i < n; i++) {
+        chunks[i].src = src + MIN(step * i, len);
+        chunks[i].end = (i == n - 1)? src + len : src + MIN(step * (i + 1), len);
+    }
+    return n;
+}
+
+/* Rewrite len symbols of src into dest, which ends at limit, and return
+ * the new length. Long strings are split between nthreads threads: each
+ * one counts the output length of its slice, a prefix sum over those
+ * gives every slice its write offset, and then all slices are copied in
+ * parallel. */
+static size_t expand(const Sym *src, size_t len, Sym *dest, const Sym *limit)
+{
+    Chunk chunks[MAX_THREADS];
+    int n = split(chunks, src, len);
+    if (n == 1) {
+        chunks[0].dest = dest;
+        chunks[0].limit = limit;
+        chunk_copy(&chunks[0]);
+        return chunks[0].len;
+    }
+    run_chunks(chunk_count, chunks, n);
+    size_t offset = 0;
+    for (int i = 0; i < n; i++) {
+        chunks[i].dest = dest + offset;
+        offset += chunks[i].len;
+        chunks[i].limit = dest + offset;
+    }
+    run_chunks(chunk_copy, chunks, n);
+    return offset;
+}
+
+/* splitmix64 */
+static uint64_t mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+    return x ^ (x >> 31);
+}
+
+static uint64_t rnd(uint64_t *state)
+{
+    return mix(*state += 0x9e3779b97f4a7c15);
+}
+
+/* Pick the alternative of a complex rule to rewrite the symbol at let
+ * with, returning its index plus one, or 0 if no alternative applies. */
+static unsigned char pick(const Sym *let, uint64_t *rng)
+{
+    const Rule *r = &rules[*let];
+    unsigned char match[MAX_ALTS];
+    int n = 0, ctx = 0;
+    double total = 0;
+    for (size_t i = 0; i < r->nalts; i++) {
+        const Alt *a = &r->alts[i];
+        if (a->llen && ((size_t)(let - cur_lo) < a->llen
+                    || memcmp(let - a->llen, a->left, sizeof(Sym) * a->llen))) {
+            continue;
+        }
+        if (a->rlen && ((size_t)(cur_hi - let - 1) < a->rlen
+                    || memcmp(let + 1, a->right, sizeof(Sym) * a->rlen))) {
+            continue;
+        }
+        int has_ctx = a->llen || a->rlen;
+        if (has_ctx < ctx) {
+            continue;
+        }
+        if (has_ctx > ctx) {
+            ctx = has_ctx;
+            n = 0;
+            total = 0;
+        }
+        match[n++] = i;
+        total += a->weight;
+    }
+    if (n <= 1) {
+        return n? match[0] + 1 : 0;
+    }
+    double x = (rnd(rng) >> 11) * 0x1p-53 * total;
+    for (int i = 0; i < n - 1; i++) {
+        if ((x -= r->alts[match[i]].weight) < 0) {
+            return match[i] + 1;
+        }
+    }
+    return match[n - 1] + 1;
+}
+
+/* Choose the alternative for every symbol of the chunk and count the
+ * output length. Deterministic symbols are decided by the table alone,
+ * and every block of symbols draws from its own random stream. */
+static void *chunk_select(void *arg)
+{
+    Chunk *c = arg;
+    const Sym *let = c->src;
+    unsigned char *s = c->sel;
+    size_t len = 0;
+    while (let != c->end) {
+        size_t block = (let - cur_lo) / BLOCK;
+        const Sym *end = c->end - let > BLOCK? let + BLOCK : c->end;
+        uint64_t rng = mix(c->seed + block);
+        for (; let != end; let++, s++) {
+            const Rule *r = &rules[*let];
+            if (!r->complex) {
+                *s = !r->identity;
+                len += r->len;
+            } else if ((*s = pick(let, &rng))) {
+                len += r->alts[*s - 1].len;
+            } else {
+                len++;
+            }
+        }
+    }
+    c->len = len;
+    return NULL;
+}
+
+static void *chunk_apply(void *arg)
+{
+    Chunk *c = arg;
+    Sym *dest = c->dest;
+    const unsigned char *s = c->sel;
+    for (const Sym *let = c->src; let != c->end; let++, s++) {
+        if (*s) {
+            const Alt *a = &rules[*let].alts[*s - 1];
+            memcpy(dest, a->val, sizeof(Sym) * a->len);
+            dest += a->len;
+        } else {
+            *dest++ = *let;
+        }
+    }
+    return NULL;
+}
+
+/* Expand the axiom depth-first, writing symbols to stdout as soon as
+ * they are final. Only one rule body per remaining iteration is kept
+ * on the stack, so memory does not depend on the length of the result. */
+static int stream(const void *axiom, size_t len, int iters)
+{
+    Frame *stack;
+    if (!(stack = malloc(sizeof *stack * ((size_t)iters + 1)))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    size_t sp = 0;
+    stack[sp++] = (Frame){axiom, (const Sym*)axiom + len, iters};
+    while (sp) {
+        Frame *f = &stack[sp - 1];
+        if (f->pos == f->end) {
+            sp--;
+            continue;
+        }
+        const Rule *r = &rules[*f->pos];
+        if (f->depth == 0 || r->identity) {
+            emit(f->pos++, 1);
+        } else if (f->depth == 1) {
+            emit(r->val, r->len);
+            f->pos++;
+        } else {
+            f->pos++;
+            stack[sp++] = (Frame){r->val, (const Sym*)r->val + r->len, f->depth - 1};
+        }
+    }
+    free(stack);
+    return out_finish();
+}
+
+/* Cache the expansion of every reachable symbol after 1, 2, ... up to
+ * memo_depth - 1 iterations while the budget lasts. Each level is built
+ * from copies of the one below, and stops the filling if none of its
+ * entries fit, as the ones above would need them. */
+static void memo_fill()
+{
+    for (int k = 1; k < memo_depth; k++) {
+        int built = 0;
+        for (size_t i = 0; i < lens_w; i++) {
+            Sym c = lens_sym[i];
+            const Rule *r = &rules[c];
+            size_t l = len_at(c, k);
+            Sym *buf;
+            if (r->identity || l > memo_left / sizeof(Sym) || !(buf = malloc(sizeof(Sym) * l))) {
+                continue;
+            }
+            Sym *dest = buf;
+            const Sym *val = r->val;
+            for (size_t j = 0; j < r->len && dest; j++) {
+                Sym d = val[j];
+                const Sym *sub = memo[(size_t)(k - 1) * lens_w + lens_col[d]];
+                size_t dlen = len_at(d, k - 1);
+                if (k == 1 || rules[d].identity) {
+                    *dest = d;
+                } else if (sub) {
+                    memcpy(dest, sub, sizeof(Sym) * dlen);
+                } else {
+                    free(buf);
+                    dest = NULL;
+                    break;
+                }
+                dest += dlen;
+            }
+            if (dest) {
+                memo_left -= sizeof(Sym) * l;
+                memo[(size_t)k * lens_w + i] = buf;
+                built = 1;
+            }
+        }
+        if (!built) {
+            return;
+        }
+    }
+}
+
+/* Write the expansion of the axiom depth-first like stream(), copying
+ * whole cached subtrees and descending only where an expansion was too
+ * big to cache. */
+static int memo_expand(const Sym *axiom, size_t len)
+{
+    Frame *stack;
+    if (!(stack = malloc(sizeof *stack * ((size_t)memo_depth + 1)))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    size_t sp = 0;
+    stack[sp++] = (Frame){axiom, axiom + len, memo_depth};
+    while (sp) {
+        Frame *f = &stack[sp - 1];
+        if (f->pos == f->end) {
+            sp--;
+            continue;
+        }
+        Sym c = *f->pos++;
+        const Rule *r = &rules[c];
+        /* the axiom's own expansions are only needed once, never cached */
+        const Sym *sub = f->depth && f->depth < memo_depth? memo[(size_t)f->depth * lens_w + lens_col[c]] : NULL;
+        if (f->depth == 0 || r->identity) {
+            emit(&c, 1);
+        } else if (sub) {
+            emit(sub, len_at(c, f->depth));
+        } else {
+            stack[sp++] = (Frame){r->val, (const Sym*)r->val + r->len, f->depth - 1};
+        }
+    }
+    free(stack);
+    return 0;
+}
+
+/* Streaming expansion backed by a cache of (symbol, depth) expansions */
+static int stream_memo(const void *axiom, size_t len, int iters, size_t budget)
+{
+    if (lens_compute(axiom, len, iters)) {
+        return 2;
+    }
+    if (!(memo = calloc((size_t)iters + 1, sizeof *memo * MAX(lens_w, 1)))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    memo_depth = iters;
+    memo_left = budget;
+    memo_fill();
+    if (memo_expand(axiom, len)) {
+        return 2;
+    }
+    return out_finish();
+}
+
+/* Write only symbols off to off + n - 1 of the result. Like stream(),
+ * but every subtree that ends before off is skipped by its length, so
+ * this takes O(iters + n) steps. */
+static int query(const void *axiom, size_t len, int iters, size_t off, size_t n)
+{
+    Frame *stack;
+    if (lens_compute(axiom, len, iters)) {
+        return 2;
+    }
+    if (!(stack = malloc(sizeof *stack * ((size_t)iters + 1)))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    size_t sp = 0;
+    stack[sp++] = (Frame){axiom, (const Sym*)axiom + len, iters};
+    while (sp && n) {
+        Frame *f = &stack[sp - 1];
+        if (f->pos == f->end) {
+            sp--;
+            continue;
+        }
+        Sym c = *f->pos++;
+        const Rule *r = &rules[c];
+        int final = f->depth == 0 || r->identity;
+        size_t l = final? 1 : len_at(c, f->depth);
+        if (l <= off) {
+            off -= l;
+        } else if (final) {
+            emit(&c, 1);
+            n--;
+        } else {
+            stack[sp++] = (Frame){r->val, (const Sym*)r->val + r->len, f->depth - 1};
+        }
+    }
+    free(stack);
+    return out_finish();
+}
+
+static void cleanup()
+{
+    free(str);
+    free(new_str);
+    free(sel);
+    if (memo) {
+        for (size_t i = 0; i < (size_t)(memo_depth + 1) * lens_w; i++) {
+            free(memo[i]);
+        }
+        free(memo);
+    }
+    free(lens);
+    free(lens_col);
+    free(lens_sym);
+    lens_sym = NULL;
+    str = new_str = NULL;
+    sel = NULL;
+    memo = NULL;
+    lens = lens_col = NULL;
+}
+
+/* Rewrite the whole string iters times with stochastic or
+ * context-sensitive rules. Lengths cannot be predicted here, so every
+ * iteration first selects the alternative for each symbol, and the
+ * buffers grow as needed before the result is copied. */
+static int iterate_complex(const Sym *axiom, size_t len, int iters)
+{
+    if (alloc(MAX(len + 1, START_SIZE))) {
+        return 2;
+    }
+    if (!(sel = malloc(size))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    memcpy(str, axiom, sizeof(Sym) * len);
+
+    for (int i = 0; i < iters; i++) {
+        Chunk chunks[MAX_THREADS];
+        int n = split(chunks, str, len);
+        cur_lo = str;
+        cur_hi = cur_lo + len;
+        for (int j = 0; j < n; j++) {
+            chunks[j].sel = sel + (chunks[j].src - cur_lo);
+            chunks[j].seed = mix(seed + i);
+        }
+        run_chunks(chunk_select, chunks, n);
+        size_t new_len = 0;
+        for (int j = 0; j < n; j++) {
+            if ((new_len += chunks[j].len) < chunks[j].len) {
+                fprintf(stderr, "result is too large\n");
+                return 2;
+            }
+        }
+        if (new_len >= size) {
+            if (new_len > (LEN_OVERFLOW / sizeof(Sym) - 1) / 2) {
+                fprintf(stderr, "result is too large\n");
+                return 2;
+            }
+            size_t lens_kept[MAX_THREADS];
+            for (int j = 0; j < n; j++) {
+                lens_kept[j] = chunks[j].len;
+            }
+            if (srealloc(new_len * 2 + 1)) {
+                return 2;
+            }
+            n = split(chunks, str, len);
+            for (int j = 0; j < n; j++) {
+                chunks[j].sel = sel + (chunks[j].src - str);
+                chunks[j].len = lens_kept[j];
+            }
+        }
+        size_t offset = 0;
+        for (int j = 0; j < n; j++) {
+            chunks[j].dest = new_str + offset;
+            offset += chunks[j].len;
+        }
+        run_chunks(chunk_apply, chunks, n);
+        len = new_len;
+        Sym *tmp = str;
+        str = new_str;
+        new_str = tmp;
+        if (iter_hook) {
+            iter_hook(i + 1, len);
+        }
+    }
+
+    emit(str, len);
+    return out_finish();
+}
+
+#if SYM_BITS == 8
+/* Rewrite len symbols of src into new_str as the last iteration, in
+ * segments, so that each one is written out while the next is expanded */
+static int expand_out(const Sym *src, size_t len)
+{
+    size_t done = 0;
+    out_async_begin((const char*)new_str);
+    for (size_t i = 0; i < len; i += SEGMENT) {
+        done += expand(src + i, MIN(SEGMENT, len - i), new_str + done, new_str + size);
+        out_async_ready(done);
+    }
+    new_str[done] = '\n';
+    out_async_ready(done + 1);
+    return out_async_end();
+}
+#endif
+
+/* Rewrite the whole string iters times, keeping it in memory */
+static int iterate(const void *axiom, size_t len, int iters)
+{
+    if (rules_complex) {
+        return iterate_complex(axiom, len, iters);
+    }
+
+    // Predict the size of every iteration before doing any work
+    size_t *counts;
+    if (lens_compute(axiom, len, iters) || !(counts = calloc(nsyms, sizeof *counts))) {
+        if (lens) {
+            fprintf(stderr, "out of memory\n");
+        }
+        return 2;
+    }
+    for (const Sym *let = axiom, *end = let + len; let != end; let++) {
+        counts[*let]++;
+    }
+    size_t max_len = len;
+    for (int i = 1; i <= iters; i++) {
+        max_len = MAX(max_len, axiom_len(counts, i));
+    }
+#if SYM_BITS == 8
+    size_t final_len = axiom_len(counts, iters);
+#endif
+    free(counts);
+    if (max_len >= LEN_OVERFLOW / sizeof(Sym) - 1) {
+        fprintf(stderr, "result is too large\n");
+        return 2;
+    }
+    if (alloc(max_len + 1)) {
+        return 2;
+    }
+    memcpy(str, axiom, sizeof(Sym) * len);
+
+#if SYM_BITS == 8
+    use_simd = use_simd && simd_init();
+
+    // The last iteration goes straight into the output file if it can be mapped
+    int direct = iters && sym_bytes && out_sink == out_write;
+    Sym *map = direct? (Sym*)out_map(final_len + 1) : NULL;
+#endif
+
+    for (int i = 0; i < iters; i++) {
+#if SYM_BITS == 8
+        if (i == iters - 1 && map) {
+            len = expand(str, len, map, map + final_len + 1);
+            map[len] = '\n';
+            return out_unmap((char*)map, final_len + 1);
+        }
+        if (i == iters - 1 && direct) {
+            return expand_out(str, len);
+        }
+#endif
+        len = expand(str, len, new_str, new_str + size);
+        Sym *tmp = str;
+        str = new_str;
+        new_str = tmp;
+        if (iter_hook) {
+            iter_hook(i + 1, len);
+        }
+    }
+
+    emit(str, len);
+    return out_finish();
+}
+
+const Engine ENGINE = {iterate, stream, stream_memo, query, cleanup};
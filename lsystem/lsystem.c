@@ -1,99 +1,387 @@
-#include <RND_HashMap.h>
+#define _GNU_SOURCE /* getopt_long */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
 
-#define MAX(a, b) ((a) > (b)? (a) : (b))
-#define START_SIZE 0xffff
+#include "bignum.h"
+#include "lsystem.h"
+#include "output.h"
+#include "rules.h"
+#include "slp.h"
+#include "turtle.h"
 
-RND_HashMap *rules;
-char *str, *new_str;
-size_t size;
+/* Symbols are printed in the order of their text */
+static int text_cmp(const void *a, const void *b)
+{
+    return strcmp(sym_text[*(const unsigned*)a], sym_text[*(const unsigned*)b]);
+}
 
-int alloc(size_t min_size)
+/* Print how many times every symbol occurs after iters iterations.
+ * With M[i][j] being how many times symbol j occurs in the rule for
+ * symbol i, the counts are the axiom's counts times M^iters, which is
+ * computed by repeated squaring in O(k^3 log iters) for k symbols. */
+int counts(const void *axiom, size_t len, unsigned iters)
 {
-    size = MAX(min_size, START_SIZE);
-    if (!(str = malloc(sizeof(char) * size))) {
+    // Collect every symbol reachable from the axiom
+    unsigned *syms = malloc(sizeof *syms * nsyms), *cnt = calloc(nsyms, sizeof *cnt);
+    int *idx = malloc(sizeof *idx * nsyms), k = 0;
+    if (!syms || !cnt || !idx) {
+        free(syms);
+        free(cnt);
+        free(idx);
         fprintf(stderr, "out of memory\n");
         return 2;
     }
-    if (!(new_str = malloc(sizeof(char) * size))) {
-        fprintf(stderr, "out of memory\n");
-        free(str);
-        return 2;
+    for (size_t c = 0; c < nsyms; c++) {
+        idx[c] = -1;
     }
-    if (!(rules = RND_hashMapCreate(10, NULL))) {
-        fprintf(stderr, "out of memory\n");
-        free(str);
-        free(new_str);
-        return 3;
+    for (size_t i = 0; i < len; i++) {
+        unsigned c = sym_at(axiom, i);
+        if (idx[c] == -1) {
+            idx[c] = k;
+            syms[k++] = c;
+        }
+    }
+    for (int i = 0; i < k; i++) {
+        const Rule *r = &rules[syms[i]];
+        for (size_t j = 0; j < r->len; j++) {
+            unsigned c = sym_at(r->val, j);
+            if (idx[c] == -1) {
+                idx[c] = k;
+                syms[k++] = c;
+            }
+        }
     }
-    return 0;
-}
 
-int srealloc(size_t new_size)
-{
-    size = new_size;
-    if (!(str = realloc(str, sizeof(char) * size))) {
+    Bignum *mat, *tmp, *vec, *vtmp;
+    mat = malloc(sizeof *mat * k * k);
+    tmp = malloc(sizeof *tmp * k * k);
+    vec = malloc(sizeof *vec * k);
+    vtmp = malloc(sizeof *vtmp * k);
+    int err = !mat || !tmp || !vec || !vtmp;
+    if (err) {
+        free(syms);
+        free(cnt);
+        free(idx);
+        free(mat);
+        free(tmp);
+        free(vec);
+        free(vtmp);
         fprintf(stderr, "out of memory\n");
         return 2;
     }
-    if (!(new_str = realloc(new_str, sizeof(char) * size))) {
+    for (int i = 0; i < k * k; i++) {
+        bn_init(&mat[i]);
+        bn_init(&tmp[i]);
+    }
+    for (int i = 0; i < k; i++) {
+        bn_init(&vec[i]);
+        bn_init(&vtmp[i]);
+    }
+
+    // Build the production matrix and the axiom's count vector
+    for (size_t i = 0; i < len; i++) {
+        cnt[idx[sym_at(axiom, i)]]++;
+    }
+    for (int i = 0; i < k; i++) {
+        err |= bn_set(&vec[i], cnt[i]);
+    }
+    for (int i = 0; i < k; i++) {
+        const Rule *r = &rules[syms[i]];
+        memset(cnt, 0, sizeof *cnt * k);
+        for (size_t j = 0; j < r->len; j++) {
+            cnt[idx[sym_at(r->val, j)]]++;
+        }
+        for (int j = 0; j < k; j++) {
+            err |= bn_set(&mat[i * k + j], cnt[j]);
+        }
+    }
+
+    while (iters && !err) {
+        Bignum *swap;
+        if (iters & 1) {
+            // vec = vec * mat
+            for (int j = 0; j < k; j++) {
+                err |= bn_set(&vtmp[j], 0);
+                for (int i = 0; i < k; i++) {
+                    err |= bn_addmul(&vtmp[j], &vec[i], &mat[i * k + j]);
+                }
+            }
+            swap = vec; vec = vtmp; vtmp = swap;
+        }
+        if (iters >>= 1) {
+            // mat = mat * mat
+            for (int i = 0; i < k; i++) {
+                for (int j = 0; j < k; j++) {
+                    Bignum *t = &tmp[i * k + j];
+                    err |= bn_set(t, 0);
+                    for (int l = 0; l < k; l++) {
+                        err |= bn_addmul(t, &mat[i * k + l], &mat[l * k + j]);
+                    }
+                }
+            }
+            swap = mat; mat = tmp; tmp = swap;
+        }
+    }
+
+    qsort(syms, k, sizeof *syms, text_cmp);
+    for (int i = 0; i < k && !err; i++) {
+        unsigned c = syms[i];
+        if (!vec[idx[c]].n) {
+            continue;
+        }
+        char *num;
+        if (!(num = bn_str(&vec[idx[c]]))) {
+            err = 1;
+            break;
+        }
+        printf("%s %s\n", sym_text[c], num);
+        free(num);
+    }
+
+    for (int i = 0; i < k * k; i++) {
+        bn_free(&mat[i]);
+        bn_free(&tmp[i]);
+    }
+    for (int i = 0; i < k; i++) {
+        bn_free(&vec[i]);
+        bn_free(&vtmp[i]);
+    }
+    free(mat);
+    free(tmp);
+    free(vec);
+    free(vtmp);
+    free(syms);
+    free(cnt);
+    free(idx);
+    if (err) {
         fprintf(stderr, "out of memory\n");
         return 2;
     }
     return 0;
 }
 
-void cleanup()
+void usage()
 {
-    free(str);
-    free(new_str);
-    RND_hashMapDestroy(rules, NULL);
+    fprintf(stderr, "usage: lsystem [-s] [-C] [-G] [-H] [-c MiB] [-o offset] [-n length] [-j threads]\n"
+            "               [-r rule]... [-f file] [-S seed] [-t svg|ppm] [-a angle] [-g geometry]\n"
+            "               [-O file] [str] iterations\n"
+            "  -s, --stream     expand depth-first without keeping the result in memory\n"
+            "  -C, --counts     only print how many times each symbol occurs in the result\n"
+            "  -G, --grammar    expand through a grammar-compressed form of the result\n"
+            "  -H, --hash       only print the length and a hash of the result, using -G\n"
+            "  -c, --cache      stream, reusing cached (symbol, depth) expansions of up to MiB in total\n"
+            "  -o, --offset     only write the result starting at this symbol\n"
+            "  -n, --length     only write this many symbols of the result\n"
+            "  -j, --jobs       number of threads to rewrite with (0 = all cores)\n"
+            "  -r, --rule       add a rule, e.g. 'a -> bc' or 'b < a > c (0.5) -> bc'\n"
+            "  -f, --file       load rules and optionally the axiom from a file\n"
+            "      --symbols    declare multi-character symbols, e.g. 'F1 F2'\n"
+            "  -S, --seed       seed for choosing between stochastic rules\n"
+            "  -t, --turtle     draw the result with turtle graphics, as svg or ppm\n"
+            "  -a, --angle      turtle turning angle in degrees (default 90)\n"
+            "  -g, --geometry   image size as WIDTHxHEIGHT (default 1024x1024)\n"
+            "      --scalar     do not use the vectorized kernel for 1-2 symbol rules\n"
+            "  -O, --output     write to a file instead of stdout\n");
 }
 
+/* The ruleset used when none is given on the command line */
+const char *default_rules[] = {
+    "a -> bc",
+    "b -> a",
+    "c -> ba",
+};
+
 int main(int argc, char **argv)
 {
-    if (argc < 3) {
+    static const struct option longopts[] = {
+        {"stream", no_argument, NULL, 's'},
+        {"counts", no_argument, NULL, 'C'},
+        {"grammar", no_argument, NULL, 'G'},
+        {"hash", no_argument, NULL, 'H'},
+        {"cache", required_argument, NULL, 'c'},
+        {"offset", required_argument, NULL, 'o'},
+        {"length", required_argument, NULL, 'n'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"rule", required_argument, NULL, 'r'},
+        {"file", required_argument, NULL, 'f'},
+        {"seed", required_argument, NULL, 'S'},
+        {"turtle", required_argument, NULL, 't'},
+        {"angle", required_argument, NULL, 'a'},
+        {"geometry", required_argument, NULL, 'g'},
+        {"scalar", no_argument, NULL, 'K'},
+        {"output", required_argument, NULL, 'O'},
+        {"symbols", required_argument, NULL, 'Y'},
+        {NULL, 0, NULL, 0}
+    };
+    int ret, have_rules = 0;
+    unsigned argn = 0;
+    seed = time(NULL);
+    int streaming = 0, slicing = 0, counting = 0, grammar = 0, hashing = 0, turtle = TURTLE_NONE, opt;
+    double angle = 90;
+    use_simd = 1;
+    unsigned width = 1024, height = 1024;
+    size_t cache = 0, offset = 0, length = LEN_OVERFLOW;
+    while ((opt = getopt_long(argc, argv, "sCGHc:o:n:j:r:f:S:t:a:g:O:", longopts, NULL)) != -1) {
+        switch (opt) {
+            case 'o': offset = strtoull(optarg, NULL, 10); slicing = 1; break;
+            case 'n': length = strtoull(optarg, NULL, 10); slicing = 1; break;
+            case 's': streaming = 1; break;
+            case 'C': counting = 1; break;
+            case 'G': grammar = 1; break;
+            case 'H': grammar = hashing = 1; break;
+            case 'c': cache = strtoul(optarg, NULL, 10) << 20; break;
+            case 'K': use_simd = 0; break;
+            case 'O':
+                /* read access lets the result be generated inside a mapping of the file */
+                if (!freopen(optarg, "w+", stdout)) {
+                    perror(optarg);
+                    rules_free();
+                    return 1;
+                }
+                break;
+            case 'S': seed = strtoull(optarg, NULL, 10); break;
+            case 't':
+                if (!strcmp(optarg, "svg")) {
+                    turtle = TURTLE_SVG;
+                } else if (!strcmp(optarg, "ppm")) {
+                    turtle = TURTLE_PPM;
+                } else {
+                    fprintf(stderr, "unknown image format '%s'\n", optarg);
+                    rules_free();
+                    return 1;
+                }
+                break;
+            case 'a': angle = atof(optarg); break;
+            case 'g':
+                if (sscanf(optarg, "%ux%u", &width, &height) != 2 || !width || !height) {
+                    fprintf(stderr, "geometry must be WIDTHxHEIGHT\n");
+                    rules_free();
+                    return 1;
+                }
+                break;
+            case 'j':
+                nthreads = atoi(optarg);
+                if (nthreads <= 0) {
+                    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                if (nthreads < 1 || nthreads > MAX_THREADS) {
+                    nthreads = nthreads < 1? 1 : MAX_THREADS;
+                }
+                break;
+            case 'r':
+                if ((ret = rules_parse(optarg, "argument", ++argn))) {
+                    rules_free();
+                    return ret;
+                }
+                have_rules = 1;
+                break;
+            case 'Y':
+                if ((ret = rules_symbols(optarg))) {
+                    rules_free();
+                    return ret;
+                }
+                break;
+            case 'f':
+                if ((ret = rules_load(optarg))) {
+                    rules_free();
+                    return ret;
+                }
+                have_rules = 1;
+                break;
+            default: usage(); rules_free(); return 1;
+        }
+    }
+    if (!have_rules) {
+        for (size_t i = 0; i < sizeof default_rules / sizeof *default_rules; i++) {
+            if ((ret = rules_parse(default_rules[i], "default", i + 1))) {
+                rules_free();
+                return ret;
+            }
+        }
+    }
+    if (argc - optind != 2 && !(rules_axiom && argc - optind == 1)) {
         fprintf(stderr, "Exactly 2 arguments (str, iterations) required\n");
+        usage();
+        rules_free();
         return 1;
     }
-    if (alloc(strlen(argv[1]) + 1)) {
-        return 2;
+    int iters = MAX(atoi(argv[argc - 1]), 0);
+    void *axiom;
+    size_t len;
+    if ((ret = rules_compile(argc - optind == 2? argv[optind] : rules_axiom, &axiom, &len))) {
+        rules_free();
+        return ret;
     }
-    strcpy(str, argv[1]);
-    int iters = atoi(argv[2]);
+    const Engine *engine = sym_width == 1? &engine8 : &engine16;
 
-    char *v1 = "bc", *v2 = "a", *v3 = "ba";
-    RND_hashMapAdd(rules, "a", v1);
-    RND_hashMapAdd(rules, "b", v2);
-    RND_hashMapAdd(rules, "c", v3);
+    if (rules_complex && (counting || slicing || cache || streaming || grammar)) {
+        fprintf(stderr, "stochastic and context-sensitive rules can only be used "
+                "without -C, -G, -H, -o, -n, -c and -s\n");
+        free(axiom);
+        rules_free();
+        return 1;
+    }
+    if (turtle && (counting || hashing)) {
+        fprintf(stderr, "-C and -H cannot be drawn\n");
+        free(axiom);
+        rules_free();
+        return 1;
+    }
+    if (turtle && (angle <= 0 || angle >= 360)) {
+        fprintf(stderr, "angle must be between 0 and 360 degrees\n");
+        free(axiom);
+        rules_free();
+        return 1;
+    }
+    if (turtle && turtle_init(turtle, angle, width, height)) {
+        fprintf(stderr, "out of memory\n");
+        free(axiom);
+        rules_free();
+        return 2;
+    }
 
-    for (int i = 0; i < iters; i++) {
-        char key[2]; key[1] = '\0';
-        size_t new_len = 1;
-        for (char *let = str; *let; let++) {
-            key[0] = *let;
-            char *val = RND_hashMapGet(rules, key);
-            new_len += strlen(val);
+    // Drawing needs one pass to measure the image and another to draw it
+    if (turtle) {
+        out_sink = turtle_feed;
+    }
+    ret = 0;
+    for (int pass = 0; pass < (turtle? 2 : 1) && !ret; pass++) {
+        if (turtle) {
+            turtle_begin(pass);
         }
-        if (new_len >= size) {
-            if (srealloc(new_len * 2 + 1)) {
-                cleanup();
-                return 2;
+        if (counting) {
+            ret = counts(axiom, len, iters);
+        } else if (grammar) {
+            if (!(ret = slp_build(axiom, len, iters))) {
+                ret = hashing? slp_hash() : slicing? slp_query(offset, length) : slp_stream();
             }
+            slp_free();
+        } else if (slicing) {
+            ret = engine->query(axiom, len, iters, offset, length);
+        } else if (cache) {
+            ret = engine->stream_memo(axiom, len, iters, cache);
+        } else if (streaming) {
+            ret = engine->stream(axiom, len, iters);
+        } else {
+            ret = engine->iterate(axiom, len, iters);
         }
-        new_str[0] = '\0';
-        char *dest = new_str;
-        for (char *let = str; *let; let++) {
-            key[0] = *let;
-            dest = stpcpy(dest, (char*)RND_hashMapGet(rules, key));
+        if (turtle && !ret && turtle_end()) {
+            fprintf(stderr, "out of memory\n");
+            ret = 2;
         }
-        char *tmp = str;
-        str = new_str;
-        new_str = tmp;
+        engine->cleanup();
+    }
+    turtle_free();
+    free(axiom);
+    rules_free();
+    if (!ret && fflush(stdout)) {
+        fprintf(stderr, "failed to write output\n");
+        ret = 2;
     }
-    
-    printf("%s\n", str);
-    cleanup();
+    return ret;
 }
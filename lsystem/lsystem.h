@@ -0,0 +1,55 @@
+/* Settings shared by main() and the rewriting engines.
+ *
+ * The engines are written once in engine.c and compiled for 8 and 16 bit
+ * symbol IDs; main() runs the build matching the ruleset's sym_width.
+ */
+#ifndef LSYSTEM_H
+#define LSYSTEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX(a, b) ((a) > (b)? (a) : (b))
+#define MIN(a, b) ((a) < (b)? (a) : (b))
+#define LEN_OVERFLOW ((size_t)-1)
+#define MAX_THREADS 256
+
+extern int nthreads;
+extern int use_simd;
+extern uint64_t seed;
+
+/* Instrumentation for benchmarks: the in-memory engines call iter_hook,
+ * if set, after every iteration, and count calls to srealloc() */
+extern void (*iter_hook)(int iter, size_t len);
+extern size_t realloc_count;
+
+/* Every entry point takes the axiom as len symbol IDs. cleanup() frees
+ * everything an engine allocated, so that it can run again. */
+typedef struct {
+    int (*iterate)(const void *axiom, size_t len, int iters);
+    int (*stream)(const void *axiom, size_t len, int iters);
+    int (*stream_memo)(const void *axiom, size_t len, int iters, size_t budget);
+    int (*query)(const void *axiom, size_t len, int iters, size_t off, size_t n);
+    void (*cleanup)();
+} Engine;
+
+extern const Engine engine8, engine16;
+
+/* Lengths saturate at LEN_OVERFLOW */
+static inline size_t add_len(size_t a, size_t b)
+{
+    if (a == LEN_OVERFLOW || b == LEN_OVERFLOW || a > LEN_OVERFLOW - b) {
+        return LEN_OVERFLOW;
+    }
+    return a + b;
+}
+
+static inline size_t mul_len(size_t a, size_t b)
+{
+    if (a == LEN_OVERFLOW || b == LEN_OVERFLOW || (a && b > LEN_OVERFLOW / a)) {
+        return LEN_OVERFLOW;
+    }
+    return a * b;
+}
+
+#endif /* LSYSTEM_H */
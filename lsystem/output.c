@@ -0,0 +1,227 @@
+#define _GNU_SOURCE /* vmsplice, F_SETPIPE_SZ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "output.h"
+
+#define CHUNK 0x100000  /* granularity of background and spliced writes */
+
+void (*out_sink)(const char *src, size_t n) = out_write;
+
+static char outbuf[OUT_SIZE];
+static size_t outlen;
+static int err;
+static int is_pipe = -1;
+static size_t pipe_cap;     /* bytes the pipe holds, 0 if not splicing */
+
+/* background writer state */
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static const char *abuf;
+static size_t aready, awritten;
+static int adone, athreaded;
+
+static void write_all(const char *src, size_t n, int splice)
+{
+    splice = splice && pipe_cap;
+    while (n && !err) {
+        ssize_t w;
+        if (splice) {
+            struct iovec iov = {(void*)src, n < CHUNK? n : CHUNK};
+            w = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+            if (w < 0 && errno != EINTR && errno != EPIPE) {
+                /* not supported here, copy instead */
+                splice = 0;
+                continue;
+            }
+        } else {
+            w = write(STDOUT_FILENO, src, n);
+        }
+        if (w < 0) {
+            err = errno != EINTR;
+            continue;
+        }
+        src += w;
+        n -= w;
+    }
+}
+
+void out_write(const char *src, size_t n)
+{
+    write_all(src, n, 0);
+}
+
+static void out_flush()
+{
+    out_sink(outbuf, outlen);
+    outlen = 0;
+}
+
+void out_put(const char *src, size_t n)
+{
+    if (n >= OUT_SIZE) {
+        out_flush();
+        out_sink(src, n);
+        return;
+    }
+    while (n > OUT_SIZE - outlen) {
+        size_t chunk = OUT_SIZE - outlen;
+        memcpy(outbuf + outlen, src, chunk);
+        outlen = OUT_SIZE;
+        out_flush();
+        src += chunk;
+        n -= chunk;
+    }
+    memcpy(outbuf + outlen, src, n);
+    outlen += n;
+}
+
+int out_finish()
+{
+    out_put("\n", 1);
+    out_flush();
+    if (err || ferror(stdout)) {
+        fprintf(stderr, "failed to write output\n");
+        return 2;
+    }
+    return 0;
+}
+
+char *out_map(size_t n)
+{
+    struct stat st;
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (flags == -1 || (flags & O_ACCMODE) != O_RDWR || (flags & O_APPEND)
+            || fstat(STDOUT_FILENO, &st) || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+    out_flush();
+    fflush(stdout);
+    off_t off = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    long page = sysconf(_SC_PAGESIZE);
+    if (off < 0 || page <= 0 || ftruncate(STDOUT_FILENO, off + n)) {
+        return NULL;
+    }
+    off_t start = off / page * page;
+    char *map = mmap(NULL, n + (off - start), PROT_READ | PROT_WRITE, MAP_SHARED,
+            STDOUT_FILENO, start);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    return map + (off - start);
+}
+
+int out_unmap(char *map, size_t n)
+{
+    off_t off = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    long page = sysconf(_SC_PAGESIZE);
+    size_t delta = off % page;
+    if (munmap(map - delta, n + delta) || lseek(STDOUT_FILENO, off + n, SEEK_SET) < 0) {
+        fprintf(stderr, "failed to write output\n");
+        return 2;
+    }
+    return 0;
+}
+
+/* How much of the first n bytes can be spliced. Spliced pages belong to
+ * the caller until the reader has consumed them, so the last pipe_cap
+ * bytes are copied instead: once they are all in the pipe, nothing that
+ * was spliced can still be in it, and the buffer can be reused. */
+static size_t splice_end(size_t n)
+{
+    return n > pipe_cap? n - pipe_cap : 0;
+}
+
+/* Write abuf from from to to, splicing what may be with ready bytes final */
+static void async_write(size_t from, size_t to, size_t ready)
+{
+    size_t mid = splice_end(ready);
+    mid = mid < from? from : mid > to? to : mid;
+    write_all(abuf + from, mid - from, 1);
+    write_all(abuf + mid, to - mid, 0);
+}
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!adone && splice_end(aready) < awritten + CHUNK) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        size_t from = awritten, to = adone? aready : splice_end(aready) / CHUNK * CHUNK;
+        size_t ready = aready;
+        int done = adone;
+        pthread_mutex_unlock(&lock);
+        async_write(from, to, ready);
+        pthread_mutex_lock(&lock);
+        awritten = to;
+        if (done) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void out_async_begin(const char *buf)
+{
+    out_flush();
+    fflush(stdout);
+    if (is_pipe == -1) {
+        struct stat st;
+        int size;
+        is_pipe = !fstat(STDOUT_FILENO, &st) && S_ISFIFO(st.st_mode);
+        if (is_pipe) {
+            fcntl(STDOUT_FILENO, F_SETPIPE_SZ, CHUNK);
+            size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+            pipe_cap = size > 0? size : 0;
+        }
+    }
+    abuf = buf;
+    aready = awritten = 0;
+    adone = 0;
+    athreaded = !pthread_create(&writer, NULL, writer_main, NULL);
+}
+
+void out_async_ready(size_t n)
+{
+    if (!athreaded) {
+        aready = n;
+        if (splice_end(n) > awritten) {
+            async_write(awritten, splice_end(n), n);
+            awritten = splice_end(n);
+        }
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    aready = n;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+int out_async_end()
+{
+    if (athreaded) {
+        pthread_mutex_lock(&lock);
+        adone = 1;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&lock);
+        pthread_join(writer, NULL);
+    } else {
+        async_write(awritten, aready, aready);
+    }
+    if (err) {
+        fprintf(stderr, "failed to write output\n");
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,45 @@
+/* Output stage shared by every engine.
+ *
+ * Streamed symbols are staged in a fixed buffer and handed to the
+ * current sink, which is either stdout or the turtle interpreter.
+ * Results that are complete in memory can instead go out in large
+ * chunks: written by a background thread as they are finished, spliced
+ * into stdout with vmsplice when it is a pipe, or generated directly
+ * inside an mmap of stdout when it is a regular file opened for reading
+ * and writing (e.g. with -O), in which case they are never copied.
+ */
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+#define OUT_SIZE 0x10000
+
+/* where staged output goes, out_write by default */
+extern void (*out_sink)(const char *src, size_t n);
+
+/* write to stdout */
+void out_write(const char *src, size_t n);
+
+void out_put(const char *src, size_t n);
+
+/* Write the last pending output and the trailing newline.
+ * Returns nonzero if any write failed. */
+int out_finish();
+
+/* Extend stdout by n bytes and map them, or return NULL if stdout
+ * cannot be mapped. out_unmap() commits the mapping, returning nonzero
+ * on failure. */
+char *out_map(size_t n);
+int out_unmap(char *map, size_t n);
+
+/* Write buf in the background, as out_async_ready() reports how much of
+ * it is final. No byte marked as ready may be changed afterwards, since
+ * the pages may be spliced into a pipe. out_async_end() waits for the
+ * writes to complete, which copy the end of buf so that no spliced page
+ * can still be in the pipe, and returns nonzero if any of them failed. */
+void out_async_begin(const char *buf);
+void out_async_ready(size_t n);
+int out_async_end();
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,432 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rules.h"
+
+#define LINE_SIZE 4096
+
+/* A rule as written, kept as text until every token is known */
+typedef struct {
+    char *pred, *left, *right, *val;
+    double weight;
+    const char *src;
+    unsigned line;
+} Def;
+
+Rule *rules;
+size_t nsyms;
+int sym_width;
+int sym_bytes;
+const char **sym_text;
+int rules_complex;
+char *rules_axiom;
+
+static Def *defs;
+static size_t ndefs;
+static char **toks;     /* multi-character symbols */
+static size_t ntoks;
+static void *ident;
+static char bytes[256][2];
+
+/* Copy src without whitespace into a new string */
+static char *strip(const char *src, size_t n)
+{
+    char *ret, *dest;
+    if (!(ret = dest = malloc(n + 1))) {
+        return NULL;
+    }
+    for (const char *end = src + n; src != end; src++) {
+        if (!isspace((unsigned char)*src)) {
+            *dest++ = *src;
+        }
+    }
+    *dest = '\0';
+    return ret;
+}
+
+/* If def ends with "(weight)", cut it off and store the weight */
+static int parse_weight(char *def, double *weight)
+{
+    size_t len = strlen(def);
+    char *open, *end;
+    *weight = 1;
+    if (len < 3 || def[len - 1] != ')' || !(open = strrchr(def, '('))) {
+        return 0;
+    }
+    double w = strtod(open + 1, &end);
+    if (end != def + len - 1 || end == open + 1) {
+        return 0;
+    }
+    if (!(w > 0)) {
+        return 1;
+    }
+    *weight = w;
+    *open = '\0';
+    return 0;
+}
+
+/* Declare tok as a symbol unless it is a single byte or already known */
+static int add_token(const char *tok, size_t len)
+{
+    if (len < 2) {
+        return 0;
+    }
+    for (size_t i = 0; i < ntoks; i++) {
+        if (strlen(toks[i]) == len && !memcmp(toks[i], tok, len)) {
+            return 0;
+        }
+    }
+    char **t;
+    if (!(t = realloc(toks, sizeof *t * (ntoks + 1)))) {
+        return 2;
+    }
+    toks = t;
+    if (!(toks[ntoks] = strndup(tok, len))) {
+        return 2;
+    }
+    ntoks++;
+    return 0;
+}
+
+int rules_parse(const char *def, const char *src, unsigned line)
+{
+    const char *arrow = strstr(def, "->");
+    char *lhs, *sym, *lt, *gt;
+    Def d = {0};
+    if (!arrow) {
+        fprintf(stderr, "%s:%u: expected 'symbol -> replacement'\n", src, line);
+        return 1;
+    }
+    if (!(lhs = strip(def, arrow - def))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    if (parse_weight(lhs, &d.weight)) {
+        fprintf(stderr, "%s:%u: weight must be positive\n", src, line);
+        free(lhs);
+        return 1;
+    }
+
+    // Split "left < sym > right" into its parts
+    char *left = "", *right = "";
+    sym = lhs;
+    if (strlen(lhs) > 1 && (lt = strchr(lhs, '<'))) {
+        *lt = '\0';
+        left = lhs;
+        sym = lt + 1;
+    }
+    if (*sym && (gt = strchr(sym + 1, '>'))) {
+        *gt = '\0';
+        right = gt + 1;
+    }
+    if (!*sym) {
+        fprintf(stderr, "%s:%u: missing symbol\n", src, line);
+        free(lhs);
+        return 1;
+    }
+    d.pred = strdup(sym);
+    d.left = strdup(left);
+    d.right = strdup(right);
+    d.val = strip(arrow + 2, strlen(arrow + 2));
+    d.src = src;
+    d.line = line;
+    free(lhs);
+
+    Def *nd = NULL;
+    if (!d.pred || !d.left || !d.right || !d.val
+            || add_token(d.pred, strlen(d.pred))
+            || !(nd = realloc(defs, sizeof *defs * (ndefs + 1)))) {
+        fprintf(stderr, "out of memory\n");
+        free(d.pred);
+        free(d.left);
+        free(d.right);
+        free(d.val);
+        return 2;
+    }
+    defs = nd;
+    defs[ndefs++] = d;
+    return 0;
+}
+
+int rules_symbols(const char *list)
+{
+    while (*list) {
+        size_t n = strcspn(list, " \t\r\n\v\f");
+        if (add_token(list, n)) {
+            fprintf(stderr, "out of memory\n");
+            return 2;
+        }
+        list += n;
+        list += strspn(list, " \t\r\n\v\f");
+    }
+    return 0;
+}
+
+int rules_load(const char *path)
+{
+    FILE *file;
+    if (!(file = fopen(path, "r"))) {
+        perror(path);
+        return 1;
+    }
+    char buf[LINE_SIZE];
+    unsigned line = 0;
+    int ret = 0;
+    while (!ret && fgets(buf, LINE_SIZE, file)) {
+        line++;
+        char *p = buf;
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (!*p || *p == '#') {
+            continue;
+        }
+        if (!strncmp(p, "axiom", 5) && isspace((unsigned char)p[5]) && !strstr(p, "->")) {
+            free(rules_axiom);
+            if (!(rules_axiom = strip(p + 5, strlen(p + 5)))) {
+                fprintf(stderr, "out of memory\n");
+                ret = 2;
+            }
+            continue;
+        }
+        if (!strncmp(p, "symbols", 7) && isspace((unsigned char)p[7]) && !strstr(p, "->")) {
+            ret = rules_symbols(p + 7 + strspn(p + 7, " \t\r\n\v\f"));
+            continue;
+        }
+        ret = rules_parse(p, path, line);
+    }
+    if (!ret && ferror(file)) {
+        perror(path);
+        ret = 1;
+    }
+    fclose(file);
+    return ret;
+}
+
+/* Longer tokens first, so that the first match is the longest one */
+static int tok_cmp(const void *a, const void *b)
+{
+    const char *x = *(char* const*)a, *y = *(char* const*)b;
+    if ((unsigned char)*x != (unsigned char)*y) {
+        return (unsigned char)*x - (unsigned char)*y;
+    }
+    size_t lx = strlen(x), ly = strlen(y);
+    return lx == ly? strcmp(x, y) : lx < ly? 1 : -1;
+}
+
+/* first[b] to first[b + 1] are the tokens starting with byte b; tokens
+ * get IDs 1 to ntoks in that order and bytes are numbered as they appear */
+static size_t first[257];
+static unsigned byte_id[256];
+
+/* Split text into symbol IDs, returning them as an array of n IDs */
+static unsigned *tokenize(const char *text, size_t *n)
+{
+    unsigned *ids;
+    if (!(ids = malloc(sizeof *ids * (strlen(text) + 1)))) {
+        return NULL;
+    }
+    size_t k = 0;
+    while (*text) {
+        unsigned char b = *text;
+        size_t i;
+        for (i = first[b]; i < first[b + 1]; i++) {
+            if (!strncmp(text, toks[i], strlen(toks[i]))) {
+                break;
+            }
+        }
+        if (i < first[b + 1]) {
+            ids[k++] = i + 1;
+            text += strlen(toks[i]);
+            continue;
+        }
+        if (!byte_id[b]) {
+            byte_id[b] = nsyms++;
+        }
+        ids[k++] = byte_id[b];
+        text++;
+    }
+    *n = k;
+    return ids;
+}
+
+/* Store n IDs with the final width, or return NULL if out of memory */
+static void *pack(const unsigned *ids, size_t n)
+{
+    void *ret;
+    if (!(ret = malloc(n * sym_width + 1))) {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (sym_width == 1) {
+            ((uint8_t*)ret)[i] = ids[i];
+        } else {
+            ((uint16_t*)ret)[i] = ids[i];
+        }
+    }
+    return ret;
+}
+
+int rules_compile(const char *axiom, void **syms, size_t *len)
+{
+    *syms = NULL;
+    *len = 0;
+
+    // Number the symbols, with IDs of bytes being the bytes themselves
+    // as long as there are no tokens and 0 reserved otherwise
+    if (ntoks) {
+        qsort(toks, ntoks, sizeof *toks, tok_cmp);
+    }
+    memset(first, 0, sizeof first);
+    for (size_t i = 0; i < ntoks; i++) {
+        first[(unsigned char)toks[i][0] + 1]++;
+    }
+    for (int b = 0; b < 256; b++) {
+        first[b + 1] += first[b];
+        byte_id[b] = ntoks? 0 : b;
+        bytes[b][0] = b;
+    }
+    sym_bytes = !ntoks;
+    nsyms = ntoks? ntoks + 1 : 256;
+
+    unsigned **ids;
+    size_t *n;
+    size_t nstr = ndefs * 4 + 1;
+    ids = calloc(nstr, sizeof *ids);
+    n = calloc(nstr, sizeof *n);
+    int err = !ids || !n;
+    for (size_t i = 0; i < ndefs && !err; i++) {
+        const char *text[] = {defs[i].pred, defs[i].left, defs[i].right, defs[i].val};
+        for (int j = 0; j < 4 && !err; j++) {
+            err = !(ids[i * 4 + j] = tokenize(text[j], &n[i * 4 + j]));
+        }
+    }
+    if (!err) {
+        err = !(ids[nstr - 1] = tokenize(axiom, &n[nstr - 1]));
+    }
+    if (!err && nsyms > MAX_SYMS) {
+        fprintf(stderr, "too many symbols\n");
+        err = 1;
+    }
+    sym_width = nsyms > 256? 2 : 1;
+
+    // Every symbol starts out as an identity rule
+    if (!err && (!(rules = calloc(nsyms, sizeof *rules))
+                || !(sym_text = calloc(nsyms, sizeof *sym_text))
+                || !(ident = malloc(nsyms * sym_width)))) {
+        err = 2;
+    }
+    for (size_t i = 0; i < nsyms && !err; i++) {
+        if (sym_width == 1) {
+            ((uint8_t*)ident)[i] = i;
+        } else {
+            ((uint16_t*)ident)[i] = i;
+        }
+        rules[i].val = (char*)ident + i * sym_width;
+        rules[i].len = 1;
+        rules[i].identity = 1;
+        sym_text[i] = "";
+    }
+    for (int b = 0; b < 256 && !err; b++) {
+        if (byte_id[b]) {
+            sym_text[byte_id[b]] = bytes[b];
+        }
+    }
+    for (size_t i = 0; i < ntoks && !err; i++) {
+        sym_text[i + 1] = toks[i];
+    }
+
+    for (size_t i = 0; i < ndefs && !err; i++) {
+        unsigned **s = ids + i * 4;
+        size_t *l = n + i * 4;
+        Rule *r = &rules[s[0][0]];
+        Alt *alts;
+        if (r->nalts == MAX_ALTS) {
+            fprintf(stderr, "%s:%u: too many rules for '%s'\n",
+                    defs[i].src, defs[i].line, defs[i].pred);
+            err = 1;
+            break;
+        }
+        if (!(alts = realloc(r->alts, sizeof *alts * (r->nalts + 1)))) {
+            err = 2;
+            break;
+        }
+        r->alts = alts;
+        Alt *a = &r->alts[r->nalts++];
+        *a = (Alt){pack(s[3], l[3]), l[1]? pack(s[1], l[1]) : NULL,
+            l[2]? pack(s[2], l[2]) : NULL, l[3], l[1], l[2], defs[i].weight};
+        if (!a->val || (l[1] && !a->left) || (l[2] && !a->right)) {
+            err = 2;
+        }
+    }
+    if (!err && !(*syms = pack(ids[nstr - 1], n[nstr - 1]))) {
+        err = 2;
+    }
+    if (!err) {
+        *len = n[nstr - 1];
+    }
+    for (size_t i = 0; ids && i < nstr; i++) {
+        free(ids[i]);
+    }
+    free(ids);
+    free(n);
+    if (err == 2) {
+        fprintf(stderr, "out of memory\n");
+    }
+    if (err) {
+        return err;
+    }
+
+    rules_complex = 0;
+    for (size_t i = 0; i < nsyms; i++) {
+        Rule *r = &rules[i];
+        if (!r->nalts) {
+            continue;
+        }
+        r->val = r->alts[0].val;
+        r->len = r->alts[0].len;
+        r->identity = 0;
+        r->complex = r->nalts > 1 || r->alts[0].left || r->alts[0].right;
+        rules_complex |= r->complex;
+    }
+    return 0;
+}
+
+void rules_free()
+{
+    for (size_t i = 0; rules && i < nsyms; i++) {
+        for (size_t j = 0; j < rules[i].nalts; j++) {
+            free((void*)rules[i].alts[j].val);
+            free((void*)rules[i].alts[j].left);
+            free((void*)rules[i].alts[j].right);
+        }
+        free(rules[i].alts);
+    }
+    free(rules);
+    rules = NULL;
+    for (size_t i = 0; i < ndefs; i++) {
+        free(defs[i].pred);
+        free(defs[i].left);
+        free(defs[i].right);
+        free(defs[i].val);
+    }
+    free(defs);
+    defs = NULL;
+    ndefs = 0;
+    for (size_t i = 0; i < ntoks; i++) {
+        free(toks[i]);
+    }
+    free(toks);
+    toks = NULL;
+    ntoks = 0;
+    free(ident);
+    ident = NULL;
+    free(sym_text);
+    sym_text = NULL;
+    nsyms = 0;
+    rules_complex = 0;
+    free(rules_axiom);
+    rules_axiom = NULL;
+}
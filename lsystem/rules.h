@@ -0,0 +1,99 @@
+/* Ruleset loading and the compiled rule table used by every engine.
+ *
+ * Rules are written as "a -> bc": a predecessor symbol, an arrow and
+ * the replacement. Whitespace is not a symbol in rule definitions, so
+ * it can be used freely for readability. Rule files additionally
+ * accept "axiom <str>" and "symbols <sym>..." lines and "#" comments.
+ *
+ * The predecessor may be surrounded by a left and right context that
+ * the neighboring symbols must match, and followed by a weight:
+ *
+ *     ab < c > d (0.25) -> e
+ *
+ * Several rules for the same symbol are alternatives. Among those whose
+ * contexts match, context-sensitive ones take precedence, and one of
+ * them is picked at random in proportion to its weight (default 1).
+ *
+ * A symbol is a single byte unless it is declared with "symbols" or is
+ * the predecessor of a rule, which makes it a multi-character token
+ * such as "F1". Text is split into symbols by the longest token
+ * matching at each position. Internally every symbol is an integer ID:
+ * as long as there are no tokens, the ID of a symbol is its own byte
+ * and strings are used as they are; otherwise IDs are assigned densely
+ * from 1 and take one or two bytes depending on how many there are.
+ */
+#ifndef RULES_H
+#define RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_ALTS 254     /* alternatives per symbol, must fit in a byte */
+#define MAX_SYMS 0x10000 /* symbol IDs must fit in 16 bits */
+
+/* One of possibly many rules for a symbol. All strings are arrays of
+ * sym_width byte symbol IDs, and lengths count symbols. */
+typedef struct {
+    const void *val, *left, *right;
+    size_t len, llen, rlen;
+    double weight;
+} Alt;
+
+/* A compiled rule, indexed directly by symbol ID. Symbols without
+ * a rule are identity rules pointing into a table of all IDs, so
+ * that the hot loops never have to branch or look anything up.
+ * Symbols with a single context-free rule are deterministic and
+ * val/len hold that rule; otherwise complex is set and the rule to
+ * apply is picked from alts for every occurrence. */
+typedef struct {
+    const void *val;
+    size_t len;
+    int identity;
+    int complex;
+    Alt *alts;
+    size_t nalts;
+} Rule;
+
+/* nsyms entries, valid after rules_compile() */
+extern Rule *rules;
+extern size_t nsyms;
+
+/* bytes per symbol ID, 1 or 2 */
+extern int sym_width;
+
+/* set if symbol IDs are the symbols' own bytes */
+extern int sym_bytes;
+
+/* text of every symbol ID */
+extern const char **sym_text;
+
+/* set if any symbol has a complex rule */
+extern int rules_complex;
+
+/* axiom given by a rule file, or NULL */
+extern char *rules_axiom;
+
+/* parse a single rule definition; src and line are used in error
+ * messages. Returns 0 on success, 1 on invalid input, 2 if out of memory. */
+int rules_parse(const char *def, const char *src, unsigned line);
+
+/* declare the whitespace-separated symbols in list, same return values */
+int rules_symbols(const char *list);
+
+/* load every rule and the axiom from a file, same return values */
+int rules_load(const char *path);
+
+/* Assign symbol IDs and build the rule table once all rules are parsed.
+ * The axiom is converted to *len IDs in *syms, which the caller frees.
+ * Same return values. */
+int rules_compile(const char *axiom, void **syms, size_t *len);
+
+void rules_free();
+
+/* the i-th ID of an array of symbols */
+static inline unsigned sym_at(const void *syms, size_t i)
+{
+    return sym_width == 1? ((const uint8_t*)syms)[i] : ((const uint16_t*)syms)[i];
+}
+
+#endif /* RULES_H */
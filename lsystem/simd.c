@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* pair[c] holds the replacement of c, with a zero high byte if it is
+ * a single symbol; symbol ID 0 never occurs in a replacement */
+static uint32_t pair[256];
+
+/* shuf[m] packs 8 padded pairs whose long ones are flagged by m,
+ * producing cnt[m] bytes */
+static uint8_t shuf[256][16];
+static uint8_t cnt[256];
+
+static const unsigned char *(*kernel)(const unsigned char*, const unsigned char*,
+        char**, const char*);
+
+/* Bitmask of the 8 pairs in v that are two symbols long */
+__attribute__((target("ssse3")))
+static unsigned long_mask(__m128i v)
+{
+    __m128i single = _mm_cmpeq_epi16(_mm_srli_epi16(v, 8), _mm_setzero_si128());
+    return ~_mm_movemask_epi8(_mm_packs_epi16(single, single)) & 0xff;
+}
+
+__attribute__((target("ssse3")))
+static const unsigned char *expand_ssse3(const unsigned char *src, const unsigned char *end,
+        char **dest, const char *limit)
+{
+    char *d = *dest;
+    while (end - src >= 8 && limit - d >= 16) {
+        __m128i v = _mm_setr_epi16(pair[src[0]], pair[src[1]], pair[src[2]], pair[src[3]],
+                pair[src[4]], pair[src[5]], pair[src[6]], pair[src[7]]);
+        unsigned m = long_mask(v);
+        v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)shuf[m]));
+        _mm_storeu_si128((__m128i*)d, v);
+        d += cnt[m];
+        src += 8;
+    }
+    *dest = d;
+    return src;
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *expand_avx2(const unsigned char *src, const unsigned char *end,
+        char **dest, const char *limit)
+{
+    char *d = *dest;
+    while (end - src >= 16 && limit - d >= 32) {
+        __m128i in = _mm_loadu_si128((const __m128i*)src);
+        __m256i lo = _mm256_i32gather_epi32((const int*)pair, _mm256_cvtepu8_epi32(in), 4);
+        __m256i hi = _mm256_i32gather_epi32((const int*)pair,
+                _mm256_cvtepu8_epi32(_mm_srli_si128(in, 8)), 4);
+        /* narrow to 16 bits, fixing up the lane order packus leaves */
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+        __m256i single = _mm256_cmpeq_epi16(_mm256_srli_epi16(v, 8), _mm256_setzero_si256());
+        unsigned singles = _mm256_movemask_epi8(_mm256_packs_epi16(single, single));
+        unsigned m0 = ~singles & 0xff, m1 = ~(singles >> 16) & 0xff;
+        __m256i s = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)shuf[m0])),
+                _mm_loadu_si128((const __m128i*)shuf[m1]), 1);
+        v = _mm256_shuffle_epi8(v, s);
+        _mm_storeu_si128((__m128i*)d, _mm256_castsi256_si128(v));
+        d += cnt[m0];
+        _mm_storeu_si128((__m128i*)d, _mm256_extracti128_si256(v, 1));
+        d += cnt[m1];
+        src += 16;
+    }
+    *dest = d;
+    return src;
+}
+
+int simd_init()
+{
+    kernel = NULL;
+    if (sym_width != 1) {
+        return 0;
+    }
+    for (size_t c = 0; c < 256; c++) {
+        if (c >= nsyms) {
+            pair[c] = 0;
+            continue;
+        }
+        const Rule *r = &rules[c];
+        const uint8_t *val = r->val;
+        if (r->complex || r->len < 1 || r->len > 2) {
+            return 0;
+        }
+        pair[c] = val[0] | (r->len == 2? val[1] << 8 : 0);
+    }
+    for (int m = 0; m < 256; m++) {
+        int n = 0;
+        for (int i = 0; i < 8; i++) {
+            shuf[m][n++] = 2 * i;
+            if (m & (1 << i)) {
+                shuf[m][n++] = 2 * i + 1;
+            }
+        }
+        cnt[m] = n;
+        while (n < 16) {
+            shuf[m][n++] = 0x80;
+        }
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = expand_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        kernel = expand_ssse3;
+    }
+    return kernel != NULL;
+}
+
+const unsigned char *simd_expand(const unsigned char *src, const unsigned char *end,
+        char **dest, const char *limit)
+{
+    return kernel(src, end, dest, limit);
+}
+
+#else /* no vector kernels for this architecture */
+
+int simd_init()
+{
+    return 0;
+}
+
+const unsigned char *simd_expand(const unsigned char *src, const unsigned char *end,
+        char **dest, const char *limit)
+{
+    (void)end;
+    (void)dest;
+    (void)limit;
+    return src;
+}
+
+#endif
@@ -0,0 +1,21 @@
+/* Vectorized rewrite kernel for rulesets where every replacement is one
+ * or two symbols long. Replacements are looked up 8 or 16 symbols at a
+ * time, their lengths turned into a byte mask, and the padded pairs are
+ * compacted with a single shuffle per 8 symbols. The kernel is picked
+ * at runtime from what the CPU supports (AVX2 or SSSE3). */
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "rules.h"
+
+/* Prepare the kernel for the current rule table. Returns nonzero if
+ * the ruleset and the CPU allow it to be used. */
+int simd_init();
+
+/* Rewrite symbols from src until fewer than a full vector of them is
+ * left or the output would get too close to limit. Advances *dest and
+ * returns the first symbol that was not rewritten. */
+const unsigned char *simd_expand(const unsigned char *src, const unsigned char *end,
+        char **dest, const char *limit);
+
+#endif /* SIMD_H */
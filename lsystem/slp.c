@@ -0,0 +1,316 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lsystem.h"
+#include "output.h"
+#include "rules.h"
+#include "slp.h"
+
+#define HASH_MOD 0x1fffffffffffffffULL  /* 2^61 - 1 */
+#define HASH_BASE 0x1000193ULL
+
+/* A nonterminal. References to children below nsyms are terminals,
+ * the others are nonterminal ref - nsyms. */
+typedef struct {
+    size_t first, n;        /* children are kids[first] to kids[first + n - 1] */
+    size_t len;             /* length in symbols, or LEN_OVERFLOW */
+    uint64_t hash, pow;     /* hash of the text and HASH_BASE^its length */
+} Node;
+
+static Node *nodes;
+static size_t nnodes, cap_nodes;
+static uint32_t *kids;
+static size_t nkids, cap_kids;
+static uint32_t root;
+static int depth;
+
+/* hash-consing table of node indices plus one, 0 marks a free slot */
+static uint32_t *table;
+static size_t table_size;
+
+/* per terminal text length, hash and power */
+static size_t *tlen;
+static uint64_t *thash, *tpow;
+
+__extension__ typedef unsigned __int128 u128;
+
+static uint64_t mulmod(uint64_t a, uint64_t b)
+{
+    u128 x = (u128)a * b;
+    uint64_t r = (uint64_t)(x & HASH_MOD) + (uint64_t)(x >> 61);
+    return r >= HASH_MOD? r - HASH_MOD : r;
+}
+
+static uint64_t addmod(uint64_t a, uint64_t b)
+{
+    uint64_t r = a + b;
+    return r >= HASH_MOD? r - HASH_MOD : r;
+}
+
+static size_t ref_len(uint32_t ref)
+{
+    return ref < nsyms? 1 : nodes[ref - nsyms].len;
+}
+
+static uint64_t kids_hash(const uint32_t *k, size_t n)
+{
+    uint64_t h = n;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ k[i]) * 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+static int table_grow()
+{
+    size_t size = table_size? table_size * 2 : 1024;
+    uint32_t *t;
+    if (!(t = calloc(size, sizeof *t))) {
+        return 2;
+    }
+    for (size_t i = 0; i < nnodes; i++) {
+        size_t j = kids_hash(kids + nodes[i].first, nodes[i].n) & (size - 1);
+        while (t[j]) {
+            j = (j + 1) & (size - 1);
+        }
+        t[j] = i + 1;
+    }
+    free(table);
+    table = t;
+    table_size = size;
+    return 0;
+}
+
+/* Return the reference of the nonterminal with the n children at the
+ * end of kids[], adding it if there is none yet, or 0 if out of memory */
+static uint32_t intern(size_t n)
+{
+    const uint32_t *k = kids + nkids - n;
+    if ((nnodes + 1) * 2 > table_size && table_grow()) {
+        return 0;
+    }
+    size_t j = kids_hash(k, n) & (table_size - 1);
+    for (; table[j]; j = (j + 1) & (table_size - 1)) {
+        const Node *d = &nodes[table[j] - 1];
+        if (d->n == n && !memcmp(kids + d->first, k, sizeof *k * n)) {
+            nkids -= n;
+            return nsyms + table[j] - 1;
+        }
+    }
+    if (nnodes == cap_nodes) {
+        Node *nd;
+        if (nnodes + 1 > UINT32_MAX - nsyms
+                || !(nd = realloc(nodes, sizeof *nd * (cap_nodes = cap_nodes * 2 + 64)))) {
+            return 0;
+        }
+        nodes = nd;
+    }
+    Node *d = &nodes[nnodes];
+    *d = (Node){nkids - n, n, 0, 0, 1};
+    for (size_t i = 0; i < n; i++) {
+        uint32_t c = k[i];
+        const Node *e = c < nsyms? NULL : &nodes[c - nsyms];
+        d->len = add_len(d->len, e? e->len : 1);
+        d->hash = addmod(mulmod(d->hash, e? e->pow : tpow[c]), e? e->hash : thash[c]);
+        d->pow = mulmod(d->pow, e? e->pow : tpow[c]);
+    }
+    table[j] = ++nnodes;
+    return nsyms + nnodes - 1;
+}
+
+/* Make room for n more children */
+static int reserve(size_t n)
+{
+    if (nkids + n <= cap_kids) {
+        return 0;
+    }
+    uint32_t *k;
+    size_t cap = MAX(cap_kids * 2, nkids + n);
+    if (!(k = realloc(kids, sizeof *k * cap))) {
+        return 2;
+    }
+    kids = k;
+    cap_kids = cap;
+    return 0;
+}
+
+int slp_build(const void *axiom, size_t len, int iters)
+{
+    // Terminals, and the symbols reachable from the axiom
+    uint32_t *cur = malloc(sizeof *cur * nsyms), *next = malloc(sizeof *next * nsyms);
+    unsigned *reach = malloc(sizeof *reach * nsyms);
+    char *seen = calloc(nsyms, 1);
+    tlen = malloc(sizeof *tlen * nsyms);
+    thash = malloc(sizeof *thash * nsyms);
+    tpow = malloc(sizeof *tpow * nsyms);
+    int err = !cur || !next || !reach || !seen || !tlen || !thash || !tpow;
+    size_t k = 0;
+    for (size_t c = 0; c < nsyms && !err; c++) {
+        cur[c] = c;
+        tlen[c] = strlen(sym_text[c]);
+        thash[c] = 0;
+        tpow[c] = 1;
+        for (size_t i = 0; i < tlen[c]; i++) {
+            thash[c] = addmod(mulmod(thash[c], HASH_BASE), (unsigned char)sym_text[c][i]);
+            tpow[c] = mulmod(tpow[c], HASH_BASE);
+        }
+    }
+    for (size_t i = 0; i < len && !err; i++) {
+        unsigned c = sym_at(axiom, i);
+        if (!seen[c]) {
+            seen[c] = 1;
+            reach[k++] = c;
+        }
+    }
+    for (size_t i = 0; i < k; i++) {
+        const Rule *r = &rules[reach[i]];
+        for (size_t j = 0; j < r->len; j++) {
+            unsigned c = sym_at(r->val, j);
+            if (!seen[c]) {
+                seen[c] = 1;
+                reach[k++] = c;
+            }
+        }
+    }
+
+    // One level of nonterminals per iteration
+    for (int it = 0; it < iters && !err; it++) {
+        for (size_t i = 0; i < k && !err; i++) {
+            unsigned c = reach[i];
+            const Rule *r = &rules[c];
+            if (r->identity || r->len == 1) {
+                next[c] = cur[sym_at(r->val, 0)];
+                continue;
+            }
+            if (reserve(r->len)) {
+                err = 1;
+                break;
+            }
+            for (size_t j = 0; j < r->len; j++) {
+                kids[nkids++] = cur[sym_at(r->val, j)];
+            }
+            err = !(next[c] = intern(r->len));
+        }
+        uint32_t *tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    depth = iters + 1;
+
+    // The axiom is the root
+    if (!err && reserve(len)) {
+        err = 1;
+    }
+    for (size_t i = 0; i < len && !err; i++) {
+        kids[nkids++] = cur[sym_at(axiom, i)];
+    }
+    if (!err && !(root = intern(len))) {
+        err = 1;
+    }
+    free(cur);
+    free(next);
+    free(reach);
+    free(seen);
+    if (err) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    return 0;
+}
+
+/* A node whose children are being written */
+typedef struct {
+    const uint32_t *pos, *end;
+} Frame;
+
+int slp_stream()
+{
+    Frame *stack;
+    if (!(stack = malloc(sizeof *stack * ((size_t)depth + 1)))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    size_t sp = 0;
+    const Node *d = &nodes[root - nsyms];
+    stack[sp++] = (Frame){kids + d->first, kids + d->first + d->n};
+    while (sp) {
+        Frame *f = &stack[sp - 1];
+        if (f->pos == f->end) {
+            sp--;
+            continue;
+        }
+        uint32_t ref = *f->pos++;
+        if (ref < nsyms) {
+            out_put(sym_text[ref], tlen[ref]);
+            continue;
+        }
+        d = &nodes[ref - nsyms];
+        stack[sp++] = (Frame){kids + d->first, kids + d->first + d->n};
+    }
+    free(stack);
+    return out_finish();
+}
+
+/* Like slp_stream(), but every child that ends before off is skipped by
+ * its length, and writing stops after n symbols */
+int slp_query(size_t off, size_t n)
+{
+    Frame *stack;
+    if (!(stack = malloc(sizeof *stack * ((size_t)depth + 1)))) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    size_t sp = 0;
+    const Node *d = &nodes[root - nsyms];
+    stack[sp++] = (Frame){kids + d->first, kids + d->first + d->n};
+    while (sp && n) {
+        Frame *f = &stack[sp - 1];
+        if (f->pos == f->end) {
+            sp--;
+            continue;
+        }
+        uint32_t ref = *f->pos++;
+        size_t len = ref_len(ref);
+        if (len <= off) {
+            off -= len;
+        } else if (ref < nsyms) {
+            out_put(sym_text[ref], tlen[ref]);
+            n--;
+        } else {
+            d = &nodes[ref - nsyms];
+            stack[sp++] = (Frame){kids + d->first, kids + d->first + d->n};
+        }
+    }
+    free(stack);
+    return out_finish();
+}
+
+int slp_hash()
+{
+    const Node *d = &nodes[root - nsyms];
+    if (d->len == LEN_OVERFLOW) {
+        printf("length overflow\n");
+    } else {
+        printf("length %zu\n", d->len);
+    }
+    printf("hash %016" PRIx64 "\n", d->hash);
+    return 0;
+}
+
+void slp_free()
+{
+    free(nodes);
+    free(kids);
+    free(table);
+    free(tlen);
+    free(thash);
+    free(tpow);
+    nodes = NULL;
+    kids = NULL;
+    table = NULL;
+    tlen = NULL;
+    thash = tpow = NULL;
+    nnodes = cap_nodes = nkids = cap_kids = table_size = 0;
+}
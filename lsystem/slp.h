@@ -0,0 +1,32 @@
+/* Grammar-compressed representation of a deterministic result.
+ *
+ * The expansion of symbol c after k iterations is the concatenation of
+ * the expansions after k - 1 iterations of the symbols in the rule for
+ * c. Making each of those a nonterminal turns the whole derivation into
+ * a straight-line program: every iteration adds at most one nonterminal
+ * per symbol, referring only to those of the previous iteration, and
+ * nonterminals with the same children are shared. Its size grows with
+ * the number of iterations, not with the length of the result, which
+ * can then be decompressed on demand or queried without expanding it.
+ */
+#ifndef SLP_H
+#define SLP_H
+
+#include <stddef.h>
+
+/* Build the grammar for len symbol IDs of axiom after iters iterations.
+ * Returns 0 on success, 2 if out of memory. */
+int slp_build(const void *axiom, size_t len, int iters);
+
+/* Decompress the whole result to the output */
+int slp_stream();
+
+/* Write only symbols off to off + n - 1 of the result */
+int slp_query(size_t off, size_t n);
+
+/* Print the length of the result and a hash of its text */
+int slp_hash();
+
+void slp_free();
+
+#endif /* SLP_H */
@@ -0,0 +1,284 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "turtle.h"
+
+#define MAX_DIRS 3600   /* headings to precompute for angles dividing 360 */
+#define MARGIN 8        /* PPM border, in pixels */
+
+typedef struct {
+    double x, y;
+    long h;             /* heading, in turns of the angle */
+    int back;           /* turned around by something other than h */
+} State;
+
+static int format, pass, oom;
+static double angle;
+static unsigned width, height;
+
+static State cur, *stack;
+static size_t depth, stack_size;
+
+/* unit vectors for every heading if the angle divides 360, else NULL */
+static double *dirx, *diry;
+static long ndirs;
+
+/* bounding box of everything drawn, measured in pass 0 */
+static double minx, miny, maxx, maxy;
+static int drawn;
+
+/* SVG path segment that is still being extended */
+static double segx, segy;
+static long segh;
+static int segback;
+static int seg_open, pen_at_start;
+
+/* PPM framebuffer and the mapping from turtle to pixel coordinates */
+static unsigned char *fb;
+static double scale, offx, offy;
+
+/* keep axis-aligned steps exact */
+static double snap(double v)
+{
+    return fabs(v) < 1e-12? 0 : v;
+}
+
+static void heading(const State *s, double *dx, double *dy)
+{
+    if (dirx) {
+        long i = s->h % ndirs;
+        i += i < 0? ndirs : 0;
+        *dx = dirx[i];
+        *dy = diry[i];
+    } else {
+        double a = (90 + s->h * angle) * M_PI / 180;
+        *dx = snap(cos(a));
+        *dy = snap(sin(a));
+    }
+    if (s->back) {
+        *dx = -*dx;
+        *dy = -*dy;
+    }
+}
+
+static void svg_flush()
+{
+    if (seg_open) {
+        printf("l%.10g %.10g", segx, 0 - segy);
+        seg_open = 0;
+    }
+}
+
+static void plot(long x, long y)
+{
+    if (x >= 0 && y >= 0 && x < (long)width && y < (long)height) {
+        memset(fb + ((size_t)y * width + x) * 3, 0, 3);
+    }
+}
+
+static void ppm_line(double x0, double y0, double x1, double y1)
+{
+    long ax = lround(x0 * scale + offx), ay = lround(height - 1 - (y0 * scale + offy));
+    long bx = lround(x1 * scale + offx), by = lround(height - 1 - (y1 * scale + offy));
+    long dx = labs(bx - ax), dy = -labs(by - ay);
+    long sx = ax < bx? 1 : -1, sy = ay < by? 1 : -1;
+    long err = dx + dy;
+    while (1) {
+        plot(ax, ay);
+        if (ax == bx && ay == by) {
+            break;
+        }
+        long e2 = 2 * err;
+        if (e2 >= dy) {
+            err += dy;
+            ax += sx;
+        }
+        if (e2 <= dx) {
+            err += dx;
+            ay += sy;
+        }
+    }
+}
+
+static void forward(int draw)
+{
+    double dx, dy;
+    heading(&cur, &dx, &dy);
+    double x = cur.x + dx, y = cur.y + dy;
+    if (draw && pass == 0) {
+        if (!drawn) {
+            minx = maxx = cur.x;
+            miny = maxy = cur.y;
+            drawn = 1;
+        }
+        minx = fmin(minx, fmin(cur.x, x));
+        maxx = fmax(maxx, fmax(cur.x, x));
+        miny = fmin(miny, fmin(cur.y, y));
+        maxy = fmax(maxy, fmax(cur.y, y));
+    } else if (pass == 1 && format == TURTLE_SVG) {
+        if (!draw) {
+            svg_flush();
+            pen_at_start = 0;
+        } else {
+            if (!pen_at_start) {
+                printf("M%.10g %.10g", cur.x, 0 - cur.y);
+                pen_at_start = 1;
+            }
+            /* extend straight runs of lines instead of adding segments */
+            if (seg_open && (!dirx || segh != cur.h || segback != cur.back)) {
+                svg_flush();
+            }
+            if (!seg_open) {
+                segx = segy = 0;
+                segh = cur.h;
+                segback = cur.back;
+                seg_open = 1;
+            }
+            segx += dx;
+            segy += dy;
+        }
+    } else if (draw && pass == 1) {
+        ppm_line(cur.x, cur.y, x, y);
+    }
+    cur.x = x;
+    cur.y = y;
+}
+
+static void push()
+{
+    if (depth == stack_size) {
+        size_t n = stack_size? stack_size * 2 : 64;
+        State *s;
+        if (!(s = realloc(stack, sizeof *s * n))) {
+            oom = 1;
+            return;
+        }
+        stack = s;
+        stack_size = n;
+    }
+    stack[depth++] = cur;
+}
+
+static void pop()
+{
+    if (depth) {
+        cur = stack[--depth];
+        if (pass == 1 && format == TURTLE_SVG) {
+            svg_flush();
+            pen_at_start = 0;
+        }
+    }
+}
+
+int turtle_init(int fmt, double a, unsigned w, unsigned h)
+{
+    format = fmt;
+    angle = a;
+    width = w;
+    height = h;
+    double n = 360 / angle;
+    if (n >= 1 && n <= MAX_DIRS && fabs(n - round(n)) < 1e-9) {
+        ndirs = lround(n);
+        dirx = malloc(sizeof *dirx * ndirs);
+        diry = malloc(sizeof *diry * ndirs);
+        if (!dirx || !diry) {
+            turtle_free();
+            return 1;
+        }
+        for (long i = 0; i < ndirs; i++) {
+            double r = (90 + i * angle) * M_PI / 180;
+            dirx[i] = snap(cos(r));
+            diry[i] = snap(sin(r));
+        }
+    }
+    return 0;
+}
+
+void turtle_begin(int p)
+{
+    pass = p;
+    cur.x = cur.y = 0;
+    cur.h = cur.back = 0;
+    depth = 0;
+    seg_open = pen_at_start = 0;
+    if (pass == 0) {
+        drawn = 0;
+        minx = miny = maxx = maxy = 0;
+        return;
+    }
+    double w = maxx - minx, h = maxy - miny;
+    if (format == TURTLE_SVG) {
+        double m = fmax(fmax(w, h) * 0.01, 1);
+        printf("<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%u\" height=\"%u\" "
+                "viewBox=\"%.10g %.10g %.10g %.10g\">\n"
+                "<path fill=\"none\" stroke=\"black\" stroke-width=\"1\" "
+                "vector-effect=\"non-scaling-stroke\" d=\"",
+                width, height, minx - m, -maxy - m, w + 2 * m, h + 2 * m);
+        return;
+    }
+    if (!fb && !(fb = malloc((size_t)width * height * 3))) {
+        oom = 1;
+        return;
+    }
+    memset(fb, 0xff, (size_t)width * height * 3);
+    double sx = (width > 2 * MARGIN? width - 2 * MARGIN : 1) / fmax(w, 1e-9);
+    double sy = (height > 2 * MARGIN? height - 2 * MARGIN : 1) / fmax(h, 1e-9);
+    scale = fmin(sx, sy);
+    offx = (width - w * scale) / 2 - minx * scale;
+    offy = (height - h * scale) / 2 - miny * scale;
+}
+
+void turtle_feed(const char *src, size_t n)
+{
+    if (oom || (pass == 1 && format == TURTLE_PPM && !fb)) {
+        return;
+    }
+    for (const char *end = src + n; src != end; src++) {
+        switch (*src) {
+            case 'F': case 'G': forward(1); break;
+            case 'f': forward(0); break;
+            case '+': cur.h++; break;
+            case '-': cur.h--; break;
+            case '|':
+                if (dirx && !(ndirs & 1)) {
+                    cur.h += ndirs / 2;
+                } else {
+                    cur.back = !cur.back;
+                }
+                break;
+            case '[': push(); break;
+            case ']': pop(); break;
+        }
+    }
+}
+
+int turtle_end()
+{
+    if (oom) {
+        return 1;
+    }
+    if (pass == 1) {
+        if (format == TURTLE_SVG) {
+            svg_flush();
+            printf("\"/>\n</svg>\n");
+        } else {
+            printf("P6\n%u %u\n255\n", width, height);
+            fwrite(fb, 1, (size_t)width * height * 3, stdout);
+        }
+    }
+    return 0;
+}
+
+void turtle_free()
+{
+    free(dirx);
+    free(diry);
+    free(stack);
+    free(fb);
+    dirx = diry = NULL;
+    stack = NULL;
+    fb = NULL;
+    stack_size = depth = 0;
+}
@@ -0,0 +1,35 @@
+/* Turtle graphics interpreter for L-system output.
+ *
+ * Symbols are consumed incrementally as the engines produce them, so
+ * the string itself is never stored. Drawing takes two passes over the
+ * same output: the first one only measures the bounding box, the second
+ * one writes an SVG path or rasterizes into a fixed-size PPM framebuffer.
+ *
+ *   F, G   move forward, drawing a line
+ *   f      move forward without drawing
+ *   + -    turn left/right by the angle
+ *   |      turn around
+ *   [ ]    push/pop position and heading
+ */
+#ifndef TURTLE_H
+#define TURTLE_H
+
+#include <stddef.h>
+
+enum { TURTLE_NONE, TURTLE_SVG, TURTLE_PPM };
+
+/* Returns nonzero if out of memory */
+int turtle_init(int format, double angle, unsigned width, unsigned height);
+
+/* Start a pass over the output; 0 measures, 1 draws */
+void turtle_begin(int pass);
+
+void turtle_feed(const char *src, size_t n);
+
+/* Finish the current pass, writing the image to stdout after the last one.
+ * Returns nonzero if out of memory. */
+int turtle_end();
+
+void turtle_free();
+
+#endif /* TURTLE_H */